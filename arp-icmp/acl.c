@@ -0,0 +1,339 @@
+#include "acl.h"
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint32_t prefix_mask(int len) {
+    return len == 0 ? 0 : htonl(~0u << (32 - len));
+}
+
+static uint32_t acl_hash(const struct acl_key *key) {
+    uint64_t a, b;
+    memcpy(&a, key, sizeof(a));
+    memcpy(&b, (const char *)key + sizeof(a), sizeof(b));
+
+    uint64_t h = a * 0x9E3779B97F4A7C15ULL ^ b;
+    h ^= h >> 32;
+    h *= 0xD6E8FEB86659FD93ULL;
+    h ^= h >> 32;
+    return h;
+}
+
+/* Keeps only the fields the tuple matches on */
+static void mask_key(const struct acl_key *key, const struct acl_tuple *t, struct acl_key *res) {
+    memset(res, 0, sizeof(*res));
+    res->src = key->src & prefix_mask(t->src_len);
+    res->dst = key->dst & prefix_mask(t->dst_len);
+    res->proto = (t->wild & ACL_WILD_PROTO) ? 0 : key->proto;
+    res->sport = (t->wild & ACL_WILD_SPORT) ? 0 : key->sport;
+    res->dport = (t->wild & ACL_WILD_DPORT) ? 0 : key->dport;
+}
+
+static int parse_prefix(const char *str, uint32_t *addr, uint8_t *len) {
+    char buf[32];
+    int plen = 32;
+
+    if (strcmp(str, "any") == 0) {
+        *addr = 0;
+        *len = 0;
+        return 0;
+    }
+
+    snprintf(buf, sizeof(buf), "%s", str);
+    char *slash = strchr(buf, '/');
+    if (slash != NULL) {
+        *slash = '\0';
+        plen = atoi(slash + 1);
+    }
+
+    struct in_addr in;
+    if (inet_aton(buf, &in) == 0 || plen < 0 || plen > 32) {
+        return -1;
+    }
+
+    *addr = in.s_addr & prefix_mask(plen);
+    *len = plen;
+    return 0;
+}
+
+static int parse_port(const char *str, uint16_t *port, uint8_t *wild, uint8_t flag) {
+    if (strcmp(str, "any") == 0) {
+        *port = 0;
+        *wild |= flag;
+        return 0;
+    }
+
+    char *end;
+    long value = strtol(str, &end, 10);
+    if (*end != '\0' || value < 0 || value > 65535) {
+        return -1;
+    }
+
+    *port = htons(value);
+    return 0;
+}
+
+static int parse_proto(const char *str, uint8_t *proto, uint8_t *wild) {
+    if (strcmp(str, "any") == 0) {
+        *proto = 0;
+        *wild |= ACL_WILD_PROTO;
+        return 0;
+    }
+
+    if (strcmp(str, "icmp") == 0) {
+        *proto = IPPROTO_ICMP;
+        return 0;
+    } else if (strcmp(str, "tcp") == 0) {
+        *proto = IPPROTO_TCP;
+        return 0;
+    } else if (strcmp(str, "udp") == 0) {
+        *proto = IPPROTO_UDP;
+        return 0;
+    }
+
+    char *end;
+    long value = strtol(str, &end, 10);
+    if (*end != '\0' || value < 0 || value > 255) {
+        return -1;
+    }
+
+    *proto = value;
+    return 0;
+}
+
+static int parse_rule(char *line, struct acl_rule *rule) {
+    char action[16], proto[16], src[32], dst[32], sport[16], dport[16];
+
+    memset(rule, 0, sizeof(*rule));
+    if (sscanf(line, "%15s %15s %31s %31s %15s %15s", action, proto, src, dst, sport,
+               dport) != 6) {
+        return -1;
+    }
+
+    if (strcmp(action, "permit") == 0) {
+        rule->action = ACL_PERMIT;
+    } else if (strcmp(action, "deny") == 0) {
+        rule->action = ACL_DENY;
+    } else {
+        return -1;
+    }
+
+    if (parse_proto(proto, &rule->key.proto, &rule->wild) < 0 ||
+        parse_prefix(src, &rule->key.src, &rule->src_len) < 0 ||
+        parse_prefix(dst, &rule->key.dst, &rule->dst_len) < 0 ||
+        parse_port(sport, &rule->key.sport, &rule->wild, ACL_WILD_SPORT) < 0 ||
+        parse_port(dport, &rule->key.dport, &rule->wild, ACL_WILD_DPORT) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static struct acl_tuple *find_tuple(struct acl *acl, struct acl_rule *rule) {
+    for (int i = 0; i < acl->n_tuples; i++) {
+        struct acl_tuple *t = &acl->tuples[i];
+        if (t->src_len == rule->src_len && t->dst_len == rule->dst_len && t->wild == rule->wild) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+static int compare_tuples(const void *a, const void *b) {
+    return ((const struct acl_tuple *)a)->best - ((const struct acl_tuple *)b)->best;
+}
+
+/* Groups the rules into tuples and fills the hash tables */
+static int acl_compile(struct acl *acl) {
+    int *counts = calloc(acl->n_rules + 1, sizeof(int));
+    acl->tuples = calloc(acl->n_rules + 1, sizeof(struct acl_tuple));
+    if (counts == NULL || acl->tuples == NULL) {
+        free(counts);
+        return -1;
+    }
+
+    for (int r = 0; r < acl->n_rules; r++) {
+        struct acl_tuple *t = find_tuple(acl, &acl->rules[r]);
+        if (t == NULL) {
+            t = &acl->tuples[acl->n_tuples++];
+            t->src_len = acl->rules[r].src_len;
+            t->dst_len = acl->rules[r].dst_len;
+            t->wild = acl->rules[r].wild;
+            t->best = r;
+        }
+        counts[t - acl->tuples]++;
+    }
+
+    for (int i = 0; i < acl->n_tuples; i++) {
+        uint32_t size = 2;
+        while (size < 2 * (uint32_t)counts[i]) {
+            size <<= 1;
+        }
+
+        struct acl_tuple *t = &acl->tuples[i];
+        t->mask = size - 1;
+        t->table = malloc(size * sizeof(struct acl_entry));
+        if (t->table == NULL) {
+            free(counts);
+            return -1;
+        }
+        for (uint32_t j = 0; j < size; j++) {
+            t->table[j].rule = -1;
+        }
+    }
+    free(counts);
+
+    for (int r = 0; r < acl->n_rules; r++) {
+        struct acl_tuple *t = find_tuple(acl, &acl->rules[r]);
+        struct acl_key key;
+        mask_key(&acl->rules[r].key, t, &key);
+
+        // Linear probing; an identical earlier rule shadows this one
+        uint32_t h = acl_hash(&key) & t->mask;
+        while (t->table[h].rule != -1 && memcmp(&t->table[h].key, &key, sizeof(key)) != 0) {
+            h = (h + 1) & t->mask;
+        }
+        if (t->table[h].rule == -1) {
+            t->table[h].key = key;
+            t->table[h].rule = r;
+        }
+    }
+
+    qsort(acl->tuples, acl->n_tuples, sizeof(struct acl_tuple), compare_tuples);
+    return 0;
+}
+
+struct acl *acl_load(const char *filename) {
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        perror(filename);
+        return NULL;
+    }
+
+    struct acl *acl = calloc(1, sizeof(struct acl));
+    int capacity = 0, lineno = 0;
+    char line[256];
+
+    while (acl != NULL && fgets(line, sizeof(line), f)) {
+        lineno++;
+
+        char *comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+        if (strspn(line, " \t\r\n") == strlen(line)) {
+            continue;
+        }
+
+        if (acl->n_rules == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            struct acl_rule *rules = realloc(acl->rules, capacity * sizeof(struct acl_rule));
+            if (rules == NULL) {
+                acl_free(acl);
+                acl = NULL;
+                break;
+            }
+            acl->rules = rules;
+        }
+
+        if (parse_rule(line, &acl->rules[acl->n_rules]) < 0) {
+            fprintf(stderr, "%s:%d: invalid ACL rule\n", filename, lineno);
+            acl_free(acl);
+            acl = NULL;
+            break;
+        }
+        acl->n_rules++;
+    }
+    fclose(f);
+
+    if (acl != NULL && acl_compile(acl) < 0) {
+        acl_free(acl);
+        acl = NULL;
+    }
+
+    if (acl != NULL) {
+        printf("ACL: %d rules compiled into %d tuples\n", acl->n_rules, acl->n_tuples);
+    }
+    return acl;
+}
+
+void acl_free(struct acl *acl) {
+    if (acl == NULL) {
+        return;
+    }
+
+    if (acl->tuples != NULL) {
+        for (int i = 0; i < acl->n_tuples; i++) {
+            free(acl->tuples[i].table);
+        }
+    }
+    free(acl->tuples);
+    free(acl->rules);
+    free(acl);
+}
+
+void acl_packet_key(struct iphdr *ip_hdr, struct acl_key *key) {
+    memset(key, 0, sizeof(*key));
+    key->src = ip_hdr->saddr;
+    key->dst = ip_hdr->daddr;
+    key->proto = ip_hdr->protocol;
+
+    // Ports are only present in the first fragment
+    if ((ip_hdr->protocol == IPPROTO_TCP || ip_hdr->protocol == IPPROTO_UDP) &&
+        (ntohs(ip_hdr->frag_off) & IP_OFFMASK) == 0) {
+        uint16_t *ports = (uint16_t *)((char *)ip_hdr + ip_hdr->ihl * 4);
+        key->sport = ports[0];
+        key->dport = ports[1];
+    }
+}
+
+int acl_classify(struct acl *acl, struct acl_key *key) {
+    int best = acl->n_rules;
+
+    for (int i = 0; i < acl->n_tuples; i++) {
+        struct acl_tuple *t = &acl->tuples[i];
+        if (t->best >= best) {
+            break; // no rule in the remaining tuples can win
+        }
+
+        struct acl_key masked;
+        mask_key(key, t, &masked);
+
+        uint32_t h = acl_hash(&masked) & t->mask;
+        while (t->table[h].rule != -1) {
+            if (memcmp(&t->table[h].key, &masked, sizeof(masked)) == 0) {
+                if (t->table[h].rule < best) {
+                    best = t->table[h].rule;
+                }
+                break;
+            }
+            h = (h + 1) & t->mask;
+        }
+    }
+
+    if (best == acl->n_rules) {
+        acl->default_hits++;
+        return ACL_PERMIT;
+    }
+
+    acl->rules[best].hits++;
+    return acl->rules[best].action;
+}
+
+void acl_dump(struct acl *acl, FILE *f) {
+    fprintf(f, "ACL hits (%d rules, %d tuples)\n", acl->n_rules, acl->n_tuples);
+
+    for (int r = 0; r < acl->n_rules; r++) {
+        struct acl_rule *rule = &acl->rules[r];
+        char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &rule->key.src, src, sizeof(src));
+        inet_ntop(AF_INET, &rule->key.dst, dst, sizeof(dst));
+
+        fprintf(f, "%4d %-6s proto %3d%s %s/%d -> %s/%d sport %d%s dport %d%s: %lu\n", r,
+                rule->action == ACL_PERMIT ? "permit" : "deny", rule->key.proto,
+                (rule->wild & ACL_WILD_PROTO) ? "*" : "", src, rule->src_len, dst,
+                rule->dst_len, ntohs(rule->key.sport), (rule->wild & ACL_WILD_SPORT) ? "*" : "",
+                ntohs(rule->key.dport), (rule->wild & ACL_WILD_DPORT) ? "*" : "", rule->hits);
+    }
+    fprintf(f, "     default permit: %lu\n", acl->default_hits);
+}
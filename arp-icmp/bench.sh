@@ -0,0 +1,92 @@
+#!/bin/bash
+
+# Forwarding benchmark. Runs the router in its own network namespace, wired
+# with veth pairs to the root namespace, where trafgen sends into r-0 and
+# receives what the router forwards out of r-1. Prints one line per scenario.
+# Needs root.
+# Usage: sudo ./bench.sh [duration] [scenario...]
+# Extra router options can be passed in ROUTER_OPTS (e.g. "--busy-poll 50").
+
+NS=tgbench
+DURATION=${1:-5}
+shift 2>/dev/null
+SCENARIOS=${@:-"udp64-10k udp64 udp1500 mix flows lpm1m"}
+WORK=$(mktemp -d)
+
+cleanup() {
+    [ -n "$ROUTER_PID" ] && kill $ROUTER_PID 2>/dev/null
+    ip netns del $NS 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+make -s router trafgen || exit 1
+
+# Router interfaces: rr-0-1 (index 0, unused), r-0 (index 1, traffic in),
+# r-1 (index 2, traffic out); their peers tg-0, tg-1, tg-2 stay in the root
+# namespace
+ip netns del $NS 2>/dev/null
+ip netns add $NS
+ip -n $NS link set lo up
+for i in 0 1 2; do
+    rif=$([ $i -eq 0 ] && echo rr-0-1 || echo r-$((i - 1)))
+    ip link del tg-$i 2>/dev/null
+    ip link add tg-$i type veth peer name $rif netns $NS
+    ip link set tg-$i up
+    sysctl -qw net.ipv6.conf.tg-$i.disable_ipv6=1
+    ip -n $NS link set $rif up
+    ip -n $NS link set $rif arp off
+done
+ip -n $NS addr add 10.2.0.1/24 dev rr-0-1
+ip -n $NS addr add 10.0.0.1/24 dev r-0
+ip -n $NS addr add 10.1.0.1/16 dev r-1
+ip netns exec $NS sysctl -qw net.ipv4.ip_forward=0 net.ipv4.icmp_echo_ignore_all=1
+
+ROUTER_MAC=$(ip netns exec $NS cat /sys/class/net/r-0/address)
+cat > "$WORK/arp" <<EOF
+10.0.0.2 $(cat /sys/class/net/tg-1/address)
+10.1.0.2 $(cat /sys/class/net/tg-2/address)
+EOF
+cat > "$WORK/rtable" <<EOF
+10.0.0.0 10.0.0.2 255.255.255.0 1
+10.1.0.0 10.1.0.2 255.255.0.0 2
+EOF
+
+run() {
+    local name=$1 rtable=$2
+    shift 2
+
+    ip netns exec $NS ./router $ROUTER_OPTS --arp-table "$WORK/arp" "$rtable" \
+        rr-0-1 r-0 r-1 > /dev/null 2>&1 &
+    ROUTER_PID=$!
+    # Give it time to load the route table
+    sleep ${BENCH_SETTLE:-1}
+
+    local result
+    result=$(./trafgen --dst-mac $ROUTER_MAC --src 10.0.0.2 --gateway 10.0.0.1 \
+        --duration $DURATION "$@" tg-1 tg-2 | grep RESULT)
+    kill $ROUTER_PID 2>/dev/null
+    wait $ROUTER_PID 2>/dev/null
+    printf "%-10s %s\n" "$name" "${result#RESULT }"
+}
+
+for s in $SCENARIOS; do
+    case $s in
+        udp64-10k) run $s "$WORK/rtable" --dst 10.1.0.2 --rate 10000 ;;
+        udp64) run $s "$WORK/rtable" --dst 10.1.0.2 ;;
+        udp1500) run $s "$WORK/rtable" --dst 10.1.0.2 --size 1514 ;;
+        mix) run $s "$WORK/rtable" --dst 10.1.0.2 --size 128 --mix udp=80,icmp=15,arp=5 ;;
+        flows) run $s "$WORK/rtable" --dst 10.1.0.2 --dst-count 65000 --flows 1000 ;;
+        lpm1m)
+            # 1M /24 routes in 16.0.0.0/4, all through r-1
+            if [ ! -f "$WORK/rtable1m" ]; then
+                cp "$WORK/rtable" "$WORK/rtable1m"
+                awk 'BEGIN { for (a = 16; a < 32; a++) for (b = 0; b < 256; b++)
+                     for (c = 0; c < 256; c++)
+                         printf "%d.%d.%d.0 10.1.0.2 255.255.255.0 2\n", a, b, c }' \
+                    >> "$WORK/rtable1m"
+            fi
+            BENCH_SETTLE=5 run $s "$WORK/rtable1m" --dst 16.0.0.1 --dst-count 268435456 ;;
+        *) echo "unknown scenario $s" ;;
+    esac
+done
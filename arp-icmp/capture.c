@@ -0,0 +1,219 @@
+#include "capture.h"
+#include <pthread.h>
+#include <time.h>
+#include "stats.h"
+#include "timeutil.h"
+
+struct capture_slot {
+    uint64_t ts;   /* ns since the epoch */
+    int len;       /* on the wire */
+    int caplen;    /* stored */
+    int interface;
+    char data[CAPTURE_SNAPLEN];
+};
+
+/* Producer and consumer indexes live on separate cache lines */
+struct capture_ring {
+    uint64_t head __attribute__((aligned(CACHE_LINE))); /* written by the forwarding thread */
+    uint64_t dropped;
+    uint64_t tail __attribute__((aligned(CACHE_LINE))); /* written by the drain thread */
+    struct capture_slot slots[CAPTURE_SLOTS];
+};
+
+struct pcap_file_header {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct pcap_record_header {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+};
+
+int capture_active;
+
+static struct capture_ring *ring;
+static struct capture_filter filter = { .interface = -1 };
+static FILE *files[ROUTER_NUM_INTERFACES];
+static char file_names[ROUTER_NUM_INTERFACES][256];
+static pthread_t drain_thread;
+static int drain_started;
+static uint64_t captured;
+
+static void parse_filter(const char *text) {
+    char *copy = strdup(text);
+    DIE(copy == NULL, "memory");
+
+    for (char *tok = strtok(copy, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        char addr[32];
+        int len = 32;
+
+        if (sscanf(tok, "if=%d", &filter.interface) == 1) {
+            DIE(filter.interface < 0 || filter.interface >= ROUTER_NUM_INTERFACES,
+                "Invalid capture interface");
+        } else if (sscanf(tok, "ether=%hx", &filter.ethertype) == 1) {
+            continue;
+        } else if (sscanf(tok, "ip=%31[0-9.]/%d", addr, &len) >= 1) {
+            DIE(len < 0 || len > 32, "Invalid capture prefix");
+            filter.mask = len == 0 ? 0 : htonl(~0u << (32 - len));
+            filter.addr = inet_addr(addr) & filter.mask;
+        } else {
+            DIE(1, "Invalid capture filter");
+        }
+    }
+
+    free(copy);
+}
+
+static int filter_match(const char *frame, int len, int interface) {
+    const struct ether_header *eth_hdr = (const struct ether_header *)frame;
+    uint16_t type = ntohs(eth_hdr->ether_type);
+
+    if (filter.interface != -1 && filter.interface != interface) {
+        return 0;
+    }
+    if (filter.ethertype != 0 && filter.ethertype != type) {
+        return 0;
+    }
+    if (filter.mask == 0) {
+        return 1;
+    }
+
+    uint32_t src, dst;
+    if (type == ETHERTYPE_IP && len >= (int)(sizeof(struct ether_header) + sizeof(struct iphdr))) {
+        const struct iphdr *ip_hdr = (const struct iphdr *)(eth_hdr + 1);
+        src = ip_hdr->saddr;
+        dst = ip_hdr->daddr;
+    } else if (type == ETHERTYPE_ARP &&
+               len >= (int)(sizeof(struct ether_header) + sizeof(struct arp_header))) {
+        const struct arp_header *arp_hdr = (const struct arp_header *)(eth_hdr + 1);
+        src = arp_hdr->spa;
+        dst = arp_hdr->tpa;
+    } else {
+        return 0;
+    }
+    return (src & filter.mask) == filter.addr || (dst & filter.mask) == filter.addr;
+}
+
+static FILE *open_pcap(int interface) {
+    FILE *f = fopen(file_names[interface], "w");
+    if (f == NULL) {
+        perror(file_names[interface]);
+        return NULL;
+    }
+
+    struct pcap_file_header hdr = {
+        .magic = 0xa1b2c3d4,
+        .version_major = 2,
+        .version_minor = 4,
+        .snaplen = CAPTURE_SNAPLEN,
+        .linktype = 1, // Ethernet
+    };
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    return f;
+}
+
+static void *drain(void *arg) {
+    (void)arg;
+
+    while (1) {
+        uint64_t tail = ring->tail;
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        if (tail == head) {
+            for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+                if (files[i] != NULL) {
+                    fflush(files[i]);
+                }
+            }
+            usleep(CAPTURE_IDLE_US);
+            continue;
+        }
+
+        for (; tail != head; tail++) {
+            struct capture_slot *s = &ring->slots[tail & (CAPTURE_SLOTS - 1)];
+
+            if (files[s->interface] == NULL) {
+                files[s->interface] = open_pcap(s->interface);
+            }
+            if (files[s->interface] != NULL) {
+                struct pcap_record_header rec = {
+                    .ts_sec = s->ts / NSEC_PER_SEC,
+                    .ts_usec = s->ts % NSEC_PER_SEC / 1000,
+                    .incl_len = s->caplen,
+                    .orig_len = s->len,
+                };
+                fwrite(&rec, sizeof(rec), 1, files[s->interface]);
+                fwrite(s->data, 1, s->caplen, files[s->interface]);
+            }
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+void capture_init(const char *prefix, const char *filter_text, char *if_names[]) {
+    ring = aligned_alloc(CACHE_LINE, sizeof(struct capture_ring));
+    DIE(ring == NULL, "memory");
+    memset(ring, 0, sizeof(struct capture_ring));
+
+    if (filter_text != NULL) {
+        parse_filter(filter_text);
+    }
+    for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+        snprintf(file_names[i], sizeof(file_names[i]), "%s-%s.pcap", prefix, if_names[i]);
+    }
+}
+
+void capture_toggle(void) {
+    if (ring == NULL) {
+        fprintf(stderr, "Capture not configured (--capture)\n");
+        return;
+    }
+
+    if (!drain_started) {
+        DIE(pthread_create(&drain_thread, NULL, drain, NULL) != 0, "pthread_create");
+        pthread_detach(drain_thread);
+        drain_started = 1;
+    }
+
+    int active = !capture_active;
+    __atomic_store_n(&capture_active, active, __ATOMIC_RELAXED);
+    if (active) {
+        fprintf(stderr, "Capture started\n");
+    } else {
+        fprintf(stderr, "Capture stopped: %lu frames, %lu dropped\n", captured, ring->dropped);
+    }
+}
+
+void capture_frame(const char *frame, int len, int interface) {
+    if (!filter_match(frame, len, interface)) {
+        return;
+    }
+
+    uint64_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == CAPTURE_SLOTS) {
+        ring->dropped++;
+        return;
+    }
+
+    struct capture_slot *s = &ring->slots[head & (CAPTURE_SLOTS - 1)];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    s->ts = (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+    s->len = len;
+    s->caplen = len < CAPTURE_SNAPLEN ? len : CAPTURE_SNAPLEN;
+    s->interface = interface;
+    memcpy(s->data, frame, s->caplen);
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    captured++;
+}
@@ -0,0 +1,250 @@
+#include "egress.h"
+#include <errno.h>
+#include "capture.h"
+#include "pktbuf.h"
+#include "stats.h"
+
+const char *egress_class_names[EGRESS_CLASSES] = {
+    [EGRESS_CONTROL] = "control",
+    [EGRESS_REALTIME] = "realtime",
+    [EGRESS_ASSURED] = "assured",
+    [EGRESS_BEST_EFFORT] = "best_effort",
+};
+
+/* DRR quanta, in multiples of EGRESS_QUANTUM */
+static const int drr_weight[EGRESS_CLASSES] = {
+    [EGRESS_ASSURED] = 3,
+    [EGRESS_BEST_EFFORT] = 1,
+};
+
+/* A queued frame; shared frames keep their own Ethernet header */
+struct egress_item {
+    packet m;
+    int shared;
+    struct ether_header l2;
+};
+
+struct egress_queue {
+    struct egress_item *ring;
+    int head;
+    int len;
+    int deficit;
+};
+
+struct egress_port {
+    struct egress_queue q[EGRESS_CLASSES];
+    int backlog;
+    int drr_current;  /* class visited by the round robin */
+    int drr_credited; /* quantum already added for this visit */
+};
+
+static struct egress_port ports[ROUTER_NUM_INTERFACES];
+static int queue_depth = EGRESS_DEFAULT_DEPTH;
+static enum egress_class dscp_class[64];
+
+void egress_init(int depth) {
+    DIE(depth <= 0, "Invalid egress queue depth");
+    queue_depth = depth;
+
+    for (int dscp = 0; dscp < 64; dscp++) {
+        dscp_class[dscp] = EGRESS_BEST_EFFORT;
+    }
+    // CS6, CS7
+    dscp_class[48] = dscp_class[56] = EGRESS_CONTROL;
+    // EF, VOICE-ADMIT, CS5, CS4
+    dscp_class[46] = dscp_class[44] = dscp_class[40] = dscp_class[32] = EGRESS_REALTIME;
+    // CS2, CS3, AFxy
+    dscp_class[16] = dscp_class[24] = EGRESS_ASSURED;
+    for (int af = 1; af <= 4; af++) {
+        for (int drop = 1; drop <= 3; drop++) {
+            dscp_class[af * 8 + drop * 2] = EGRESS_ASSURED;
+        }
+    }
+
+    for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+        ports[i].drr_current = EGRESS_STRICT_CLASSES;
+    }
+}
+
+enum egress_class egress_classify(packet *m) {
+    struct ether_header *eth_hdr = (struct ether_header *)m->payload;
+    if (ntohs(eth_hdr->ether_type) != ETHERTYPE_IP) {
+        return EGRESS_CONTROL;
+    }
+
+    struct iphdr *ip_hdr = (struct iphdr *)(m->payload + sizeof(struct ether_header));
+    return dscp_class[ip_hdr->tos >> 2];
+}
+
+int egress_backlog(int interface) {
+    return ports[interface].backlog;
+}
+
+/* Next DRR class allowed to send its head frame (some DRR queue is non-empty) */
+static int drr_pick(struct egress_port *p) {
+    while (1) {
+        struct egress_queue *q = &p->q[p->drr_current];
+
+        if (q->len > 0) {
+            if (!p->drr_credited) {
+                q->deficit += drr_weight[p->drr_current] * EGRESS_QUANTUM;
+                p->drr_credited = 1;
+            }
+            if (q->ring[q->head].m.len <= q->deficit) {
+                return p->drr_current;
+            }
+        } else {
+            q->deficit = 0;
+        }
+
+        p->drr_current++;
+        if (p->drr_current == EGRESS_CLASSES) {
+            p->drr_current = EGRESS_STRICT_CLASSES;
+        }
+        p->drr_credited = 0;
+    }
+}
+
+static int pick_class(struct egress_port *p) {
+    for (int c = 0; c < EGRESS_STRICT_CLASSES; c++) {
+        if (p->q[c].len > 0) {
+            return c;
+        }
+    }
+    return drr_pick(p);
+}
+
+/* Writes l2 followed by the frame past its Ethernet header */
+static int send_shared(int interface, const struct ether_header *l2, const char *frame, int len) {
+    struct iovec iov[2] = {
+        { .iov_base = (void *)l2, .iov_len = sizeof(*l2) },
+        { .iov_base = (void *)(frame + sizeof(*l2)), .iov_len = len - sizeof(*l2) },
+    };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+
+    int ret = sendmsg(interfaces[interface], &msg, MSG_DONTWAIT);
+    if (ret >= 0 && __builtin_expect(__atomic_load_n(&capture_active, __ATOMIC_RELAXED), 0)) {
+        char copy[MAX_LEN]; // the capture needs the frame in one piece
+        memcpy(copy, l2, sizeof(*l2));
+        memcpy(copy + sizeof(*l2), frame + sizeof(*l2), len - sizeof(*l2));
+        capture_frame(copy, len, interface);
+    }
+    return ret;
+}
+
+int egress_flush(int interface) {
+    struct egress_port *p = &ports[interface];
+
+    while (p->backlog > 0) {
+        int c = pick_class(p);
+        struct egress_queue *q = &p->q[c];
+        struct egress_item *item = &q->ring[q->head];
+        packet *m = &item->m;
+
+        int ret;
+        if (item->shared) {
+            ret = send_shared(interface, &item->l2, m->payload, m->len);
+        } else {
+            ret = send(interfaces[interface], m->payload, m->len, MSG_DONTWAIT);
+        }
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break; // wait until the socket is writable
+        }
+        if (ret < 0) {
+            stats_drop(DROP_TX_ERROR);
+        } else {
+            stats_tx(interface, ret);
+            if (!item->shared) {
+                capture_tap(m->payload, m->len, interface);
+            }
+        }
+
+        if (c >= EGRESS_STRICT_CLASSES) {
+            q->deficit -= m->len;
+        }
+        pktbuf_free(m->payload);
+        q->head = (q->head + 1) % queue_depth;
+        q->len--;
+        p->backlog--;
+    }
+
+    return p->backlog;
+}
+
+/* Reserves the tail slot of the class queue of m, NULL if the queue is full */
+static struct egress_item *enqueue(int interface, packet *m) {
+    struct egress_port *p = &ports[interface];
+    enum egress_class c = egress_classify(m);
+    struct egress_queue *q = &p->q[c];
+
+    if (q->ring == NULL) {
+        q->ring = malloc(queue_depth * sizeof(struct egress_item));
+        DIE(q->ring == NULL, "memory");
+    }
+
+    if (q->len == queue_depth) {
+        stats->egress_drops[interface][c]++;
+        return NULL;
+    }
+
+    struct egress_item *item = &q->ring[(q->head + q->len) % queue_depth];
+    q->len++;
+    p->backlog++;
+    return item;
+}
+
+int egress_send(int interface, packet *m) {
+    struct egress_port *p = &ports[interface];
+
+    if (p->backlog == 0) {
+        int ret = send(interfaces[interface], m->payload, m->len, MSG_DONTWAIT);
+        if (ret >= 0) {
+            stats_tx(interface, ret);
+            capture_tap(m->payload, m->len, interface);
+            return ret;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            stats_drop(DROP_TX_ERROR);
+            return -1;
+        }
+    }
+
+    struct egress_item *item = enqueue(interface, m);
+    if (item == NULL) {
+        return -1;
+    }
+    pktbuf_clone(&item->m, m);
+    item->shared = 0;
+
+    egress_flush(interface);
+    return 0;
+}
+
+int egress_send_shared(int interface, const struct ether_header *l2, char *frame, int len) {
+    struct egress_port *p = &ports[interface];
+
+    if (p->backlog == 0) {
+        int ret = send_shared(interface, l2, frame, len);
+        if (ret >= 0) {
+            stats_tx(interface, ret);
+            return ret;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            stats_drop(DROP_TX_ERROR);
+            return -1;
+        }
+    }
+
+    packet m = { .len = len, .payload = frame };
+    struct egress_item *item = enqueue(interface, &m);
+    if (item == NULL) {
+        return -1;
+    }
+    item->m = m;
+    item->m.payload = pktbuf_ref(frame);
+    item->shared = 1;
+    item->l2 = *l2;
+
+    egress_flush(interface);
+    return 0;
+}
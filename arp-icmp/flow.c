@@ -0,0 +1,160 @@
+#include "flow.h"
+#include <endian.h>
+#include "acl.h"
+#include "skel.h"
+#include "timeutil.h"
+
+struct flow_entry {
+    struct acl_key key;
+    uint8_t in_if;
+    uint8_t out_if;
+    uint8_t used;
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t first; /* ns */
+    uint64_t last;  /* ns */
+};
+
+struct flow_cache {
+    struct flow_entry entries[FLOW_CACHE_SIZE];
+    struct flow_export_record pending[FLOW_MAX_RECORDS];
+    int n_pending;
+    unsigned int seed;
+    uint64_t next_export;
+};
+
+uint32_t flow_rate;
+__thread uint32_t flow_countdown;
+static __thread struct flow_cache *cache;
+
+static int export_fd = -1;
+static struct sockaddr_in collector_addr;
+static uint32_t sequence;
+static uint64_t export_interval;
+static uint64_t start;
+
+static uint32_t flow_hash(const struct flow_entry *e) {
+    uint32_t h = e->key.src * 0x9e3779b1u;
+    h ^= e->key.dst * 0x85ebca6bu;
+    h ^= ((uint32_t)e->key.sport << 16 | e->key.dport) * 0xc2b2ae35u;
+    h ^= (e->key.proto << 16 | e->in_if << 8 | e->out_if) * 0x27d4eb2fu;
+    return h ^ (h >> 15);
+}
+
+/* Random gap with mean flow_rate */
+static uint32_t next_skip(void) {
+    return flow_rate == 1 ? 1 : 1 + rand_r(&cache->seed) % (2 * flow_rate - 1);
+}
+
+static void send_pending(uint64_t now) {
+    char buf[sizeof(struct flow_export_header) + sizeof(cache->pending)];
+    struct flow_export_header *hdr = (struct flow_export_header *)buf;
+
+    if (cache->n_pending == 0) {
+        return;
+    }
+
+    hdr->version = htons(FLOW_VERSION);
+    hdr->count = htons(cache->n_pending);
+    hdr->sequence = htonl(__atomic_fetch_add(&sequence, 1, __ATOMIC_RELAXED));
+    hdr->sampling_rate = htonl(flow_rate);
+    hdr->uptime_ms = htonl((now - start) / NSEC_PER_MSEC);
+
+    int len = cache->n_pending * sizeof(struct flow_export_record);
+    memcpy(buf + sizeof(*hdr), cache->pending, len);
+    // Export is best effort: a lost datagram only loses visibility
+    sendto(export_fd, buf, sizeof(*hdr) + len, MSG_DONTWAIT,
+           (struct sockaddr *)&collector_addr, sizeof(collector_addr));
+    cache->n_pending = 0;
+}
+
+static void export_entry(struct flow_entry *e, uint64_t now) {
+    struct flow_export_record *r = &cache->pending[cache->n_pending];
+
+    r->src = e->key.src;
+    r->dst = e->key.dst;
+    r->sport = e->key.sport;
+    r->dport = e->key.dport;
+    r->proto = e->key.proto;
+    r->in_if = e->in_if;
+    r->out_if = e->out_if;
+    r->pad = 0;
+    r->packets = htobe64(e->packets);
+    r->bytes = htobe64(e->bytes);
+    r->first_ms = htonl((e->first - start) / NSEC_PER_MSEC);
+    r->last_ms = htonl((e->last - start) / NSEC_PER_MSEC);
+    e->used = 0;
+
+    if (++cache->n_pending == FLOW_MAX_RECORDS) {
+        send_pending(now);
+    }
+}
+
+void flow_init(const char *collector, uint32_t rate, uint32_t interval) {
+    char host[64];
+    int port;
+
+    DIE(rate == 0 || interval == 0, "Invalid flow export settings");
+    DIE(sscanf(collector, "%63[^:]:%d", host, &port) != 2, "Collector must be ip:port");
+
+    memset(&collector_addr, 0, sizeof(collector_addr));
+    collector_addr.sin_family = AF_INET;
+    collector_addr.sin_port = htons(port);
+    DIE(inet_pton(AF_INET, host, &collector_addr.sin_addr) != 1, "Invalid collector address");
+
+    export_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    DIE(export_fd < 0, "socket");
+
+    flow_rate = rate;
+    export_interval = interval * NSEC_PER_SEC;
+    start = now_ns();
+}
+
+static void cache_init(void) {
+    cache = calloc(1, sizeof(struct flow_cache));
+    DIE(cache == NULL, "memory");
+    cache->seed = start ^ (uintptr_t)cache;
+    cache->next_export = now_ns() + export_interval;
+}
+
+void flow_record(struct iphdr *ip_hdr, int in_if, int out_if) {
+    if (cache == NULL) {
+        cache_init();
+    }
+    flow_countdown = next_skip();
+
+    struct flow_entry probe;
+    memset(&probe, 0, sizeof(probe));
+    acl_packet_key(ip_hdr, &probe.key);
+    probe.in_if = in_if;
+    probe.out_if = out_if;
+
+    uint64_t now = now_ns();
+    struct flow_entry *e = &cache->entries[flow_hash(&probe) & (FLOW_CACHE_SIZE - 1)];
+    if (e->used && (memcmp(&e->key, &probe.key, sizeof(probe.key)) != 0 ||
+                    e->in_if != in_if || e->out_if != out_if)) {
+        export_entry(e, now); // collision: the older flow goes out early
+    }
+    if (!e->used) {
+        *e = probe;
+        e->used = 1;
+        e->first = now;
+    }
+    e->packets++;
+    e->bytes += ntohs(ip_hdr->tot_len);
+    e->last = now;
+}
+
+void flow_tick(uint64_t now) {
+    if (cache == NULL || now < cache->next_export) {
+        return;
+    }
+    cache->next_export = now + export_interval;
+
+    for (int i = 0; i < FLOW_CACHE_SIZE; i++) {
+        if (cache->entries[i].used) {
+            export_entry(&cache->entries[i], now);
+        }
+    }
+    send_pending(now);
+}
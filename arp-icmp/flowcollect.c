@@ -0,0 +1,62 @@
+#include <endian.h>
+#include "flow.h"
+#include "skel.h"
+
+/*
+ * flowcollect - stand-in collector for the flow records exported by the
+ * router (--flow-collector). Prints every record with its counts scaled by
+ * the sampling rate.
+ * Usage: ./flowcollect <port>
+ */
+
+int main(int argc, char *argv[]) {
+    DIE(argc != 2, "Usage: ./flowcollect <port>");
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    DIE(fd < 0, "socket");
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(atoi(argv[1]));
+    DIE(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0, "bind");
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    char buf[65536];
+    uint32_t expected = 0;
+    while (1) {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        ssize_t n = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &from_len);
+        DIE(n < 0, "recvfrom");
+
+        struct flow_export_header *hdr = (struct flow_export_header *)buf;
+        if (n < (ssize_t)sizeof(*hdr) || ntohs(hdr->version) != FLOW_VERSION) {
+            continue;
+        }
+        int count = ntohs(hdr->count);
+        if (n < (ssize_t)(sizeof(*hdr) + count * sizeof(struct flow_export_record))) {
+            continue;
+        }
+
+        uint32_t seq = ntohl(hdr->sequence);
+        uint32_t rate = ntohl(hdr->sampling_rate);
+        if (seq != expected) {
+            printf("# %u datagram(s) lost\n", seq - expected);
+        }
+        expected = seq + 1;
+
+        struct flow_export_record *r = (struct flow_export_record *)(hdr + 1);
+        for (int i = 0; i < count; i++, r++) {
+            char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &r->src, src, sizeof(src));
+            inet_ntop(AF_INET, &r->dst, dst, sizeof(dst));
+            printf("%s:%u -> %s:%u proto %u if %u->%u packets ~%lu bytes ~%lu (%u..%u ms)\n",
+                   src, ntohs(r->sport), dst, ntohs(r->dport), r->proto, r->in_if, r->out_if,
+                   be64toh(r->packets) * rate, be64toh(r->bytes) * rate,
+                   ntohl(r->first_ms), ntohl(r->last_ms));
+        }
+    }
+}
@@ -0,0 +1,101 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <netinet/ip.h>
+
+/*
+ * Rules file, one rule per line, first match wins ('#' starts a comment):
+ *   <permit|deny> <proto> <src>[/len] <dst>[/len] <sport> <dport>
+ * proto is icmp, tcp, udp, a number or any; addresses and ports may be any.
+ *
+ * Rules are compiled into a tuple space: rules sharing the same prefix
+ * lengths and wildcard fields form a tuple with its own hash table, so a
+ * lookup costs one probe per tuple regardless of the number of rules.
+ */
+
+#define ACL_PERMIT 0
+#define ACL_DENY 1
+
+#define ACL_WILD_PROTO 1
+#define ACL_WILD_SPORT 2
+#define ACL_WILD_DPORT 4
+
+struct acl_key {
+    uint32_t src;
+    uint32_t dst;
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t proto;
+    uint8_t pad[3];
+};
+
+struct acl_rule {
+    int action;
+    struct acl_key key;
+    uint8_t src_len;
+    uint8_t dst_len;
+    uint8_t wild;
+    uint64_t hits;
+};
+
+struct acl_entry {
+    struct acl_key key;
+    int rule; /* -1 for an empty slot */
+};
+
+struct acl_tuple {
+    uint8_t src_len;
+    uint8_t dst_len;
+    uint8_t wild;
+    int best;        /* lowest rule index in this tuple */
+    uint32_t mask;   /* table size - 1 */
+    struct acl_entry *table;
+};
+
+struct acl {
+    struct acl_rule *rules;
+    int n_rules;
+    struct acl_tuple *tuples; /* sorted by best rule */
+    int n_tuples;
+    uint64_t default_hits;
+};
+
+/**
+ * @brief Compiles a rules file
+ *
+ * @param filename
+ * @return struct acl* classifier or NULL if the file is invalid
+ */
+struct acl *acl_load(const char *filename);
+
+/**
+ * @brief Frees a classifier
+ *
+ * @param acl
+ */
+void acl_free(struct acl *acl);
+
+/**
+ * @brief Builds the lookup key of an IPv4 packet
+ *
+ * @param ip_hdr IP header (ports are read from the following L4 header)
+ * @param key result
+ */
+void acl_packet_key(struct iphdr *ip_hdr, struct acl_key *key);
+
+/**
+ * @brief Finds the first matching rule and counts the hit
+ *
+ * @param acl
+ * @param key
+ * @return ACL_PERMIT or ACL_DENY (ACL_PERMIT if no rule matches)
+ */
+int acl_classify(struct acl *acl, struct acl_key *key);
+
+/**
+ * @brief Prints the rules with their hit counters
+ *
+ * @param acl
+ * @param f output stream
+ */
+void acl_dump(struct acl *acl, FILE *f);
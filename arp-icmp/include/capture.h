@@ -0,0 +1,55 @@
+#pragma once
+#include <stdint.h>
+#include "skel.h"
+
+/*
+ * In-process packet capture. When active, frames received and sent by the
+ * forwarding thread that pass the filter are copied (up to the snap length)
+ * into a single-producer single-consumer ring. A background thread drains
+ * the ring into one pcap file per interface. The forwarding thread never
+ * blocks on the capture: when the ring is full the frame is only counted
+ * as dropped. SIGUSR2 starts and stops the capture.
+ */
+
+#define CAPTURE_SLOTS 4096 /* power of two */
+#define CAPTURE_SNAPLEN 2048
+#define CAPTURE_IDLE_US 1000 /* drain thread sleep when the ring is empty */
+
+struct capture_filter {
+    int interface;      /* -1 = any */
+    uint16_t ethertype; /* host order, 0 = any */
+    uint32_t addr;      /* IPv4/ARP source or destination ... */
+    uint32_t mask;      /* ... in this prefix, mask 0 = any */
+};
+
+extern int capture_active;
+
+/**
+ * @brief Arms the tap (inactive until capture_toggle)
+ *
+ * @param prefix files are named <prefix>-<interface>.pcap
+ * @param filter "if=N,ether=0xHHHH,ip=A.B.C.D[/len]", any subset, or NULL
+ * @param if_names interface names, used in the file names
+ */
+void capture_init(const char *prefix, const char *filter, char *if_names[]);
+
+/**
+ * @brief Starts or stops capturing (safe to call from the main loop only)
+ */
+void capture_toggle(void);
+
+/**
+ * @brief Copies a frame into the ring if it matches the filter
+ *
+ * @param frame Ethernet frame
+ * @param len
+ * @param interface
+ */
+void capture_frame(const char *frame, int len, int interface);
+
+/* Called on every received or sent frame */
+static inline void capture_tap(const char *frame, int len, int interface) {
+    if (__builtin_expect(__atomic_load_n(&capture_active, __ATOMIC_RELAXED), 0)) {
+        capture_frame(frame, len, interface);
+    }
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include <stdint.h>
+#include "skel.h"
+
+/*
+ * Egress scheduling. A frame is written straight to the interface while the
+ * interface has no backlog. Once the socket refuses it (EAGAIN), frames are
+ * queued by the class of their DSCP. The queues drain when the socket becomes
+ * writable again: control and realtime classes in strict priority, the others
+ * by deficit round robin. Queues are bounded and tail-drop.
+ */
+
+#define EGRESS_DEFAULT_DEPTH 256
+#define EGRESS_QUANTUM ETH_FRAME_LEN /* bytes per DRR weight unit */
+
+enum egress_class {
+    EGRESS_CONTROL,     /* CS6, CS7 */
+    EGRESS_REALTIME,    /* EF, VOICE-ADMIT, CS5, CS4 */
+    EGRESS_ASSURED,     /* AF1x-AF4x, CS2, CS3 */
+    EGRESS_BEST_EFFORT, /* everything else */
+    EGRESS_CLASSES
+};
+
+/* Classes below this one are served in strict priority */
+#define EGRESS_STRICT_CLASSES 2
+
+extern const char *egress_class_names[EGRESS_CLASSES];
+
+/**
+ * @brief Sets the depth of every class queue (allocated on first use)
+ *
+ * @param depth packets per queue
+ */
+void egress_init(int depth);
+
+/**
+ * @brief Maps the DSCP of an IPv4 frame to its class
+ *
+ * @param m packet (non-IP frames are control traffic)
+ * @return enum egress_class
+ */
+enum egress_class egress_classify(packet *m);
+
+/**
+ * @brief Sends a frame, or queues it if the interface is backlogged
+ *
+ * @param interface
+ * @param m packet (copied into a pooled buffer if queued)
+ * @return bytes sent, 0 if queued, -1 if dropped
+ */
+int egress_send(int interface, packet *m);
+
+/**
+ * @brief Sends a frame made of its own Ethernet header and the rest of a
+ * shared buffer (scatter-gather), or queues it with a reference to the
+ * buffer if the interface is backlogged. No copy of the frame is made.
+ *
+ * @param interface
+ * @param l2 Ethernet header to send
+ * @param frame pooled buffer holding the frame (its Ethernet header is ignored)
+ * @param len frame length
+ * @return bytes sent, 0 if queued, -1 if dropped
+ */
+int egress_send_shared(int interface, const struct ether_header *l2, char *frame, int len);
+
+/**
+ * @brief Sends queued frames until the backlog is empty or the socket is full
+ *
+ * @param interface
+ * @return int frames still queued
+ */
+int egress_flush(int interface);
+
+/**
+ * @brief Number of frames queued on interface
+ *
+ * @param interface
+ * @return int
+ */
+int egress_backlog(int interface);
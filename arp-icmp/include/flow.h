@@ -0,0 +1,77 @@
+#pragma once
+#include <stdint.h>
+#include <netinet/ip.h>
+
+/*
+ * Sampled flow export. One forwarded packet in `rate` (on average; the gap
+ * is randomised so periodic traffic cannot alias with it) is accounted to
+ * its flow in a per-thread cache. Every export interval, and whenever a
+ * cache slot has to be reused, the records are sent over UDP to a collector.
+ * Counts are exported as sampled; the collector scales them by the rate
+ * carried in the message header. Packets that are not sampled only pay a
+ * counter decrement.
+ */
+
+#define FLOW_CACHE_SIZE 4096 /* flows per thread, power of two */
+#define FLOW_DEFAULT_INTERVAL 10 /* seconds between exports */
+#define FLOW_VERSION 1
+#define FLOW_MAX_RECORDS 30 /* per datagram */
+
+/* Wire format, network byte order */
+struct flow_export_header {
+    uint16_t version;
+    uint16_t count;          /* records that follow */
+    uint32_t sequence;       /* of the datagram, per exporter */
+    uint32_t sampling_rate;
+    uint32_t uptime_ms;      /* when the datagram was sent */
+} __attribute__((packed));
+
+struct flow_export_record {
+    uint32_t src;
+    uint32_t dst;
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t proto;
+    uint8_t in_if;
+    uint8_t out_if;
+    uint8_t pad;
+    uint64_t packets;        /* sampled */
+    uint64_t bytes;          /* sampled */
+    uint32_t first_ms;       /* uptime of the first and last sample */
+    uint32_t last_ms;
+} __attribute__((packed));
+
+extern uint32_t flow_rate;
+extern __thread uint32_t flow_countdown;
+
+/**
+ * @brief Enables sampling and opens the export socket
+ *
+ * @param collector "ip:port" of the collector
+ * @param rate sample one packet in rate
+ * @param interval seconds between exports
+ */
+void flow_init(const char *collector, uint32_t rate, uint32_t interval);
+
+/**
+ * @brief Accounts a sampled packet to its flow
+ *
+ * @param ip_hdr
+ * @param in_if receiving interface
+ * @param out_if egress interface
+ */
+void flow_record(struct iphdr *ip_hdr, int in_if, int out_if);
+
+/**
+ * @brief Exports the flow cache of this thread when the interval elapsed
+ *
+ * @param now current time (ns)
+ */
+void flow_tick(uint64_t now);
+
+/* Called for every forwarded packet */
+static inline void flow_sample(struct iphdr *ip_hdr, int in_if, int out_if) {
+    if (flow_rate != 0 && flow_countdown-- <= 1) {
+        flow_record(ip_hdr, in_if, out_if);
+    }
+}
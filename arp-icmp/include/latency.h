@@ -0,0 +1,86 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "timeutil.h"
+
+/*
+ * Log-linear (HDR style) histogram: values below 2 * LAT_SUB_COUNT are
+ * exact, larger ones keep LAT_SUB_BITS significant bits (~3% error).
+ */
+#define LAT_SUB_BITS 5
+#define LAT_SUB_COUNT (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS ((64 - LAT_SUB_BITS + 1) * LAT_SUB_COUNT)
+
+enum lat_stage {
+    LAT_CLASSIFY, /* parsing, checksum and TTL checks */
+    LAT_LPM,      /* route lookup */
+    LAT_NEIGH,    /* ARP table lookup */
+    LAT_TX,       /* Ethernet rewrite and send_packet */
+    LAT_TOTAL,    /* get_packet return to send_packet completion */
+    LAT_STAGE_MAX
+};
+
+struct lat_histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[LAT_BUCKETS];
+};
+
+extern int latency_enabled;
+extern uint64_t lat_start, lat_last;
+
+/**
+ * @brief Enables the histograms and calibrates the timestamp counter
+ */
+void latency_init(void);
+
+/**
+ * @brief Adds a value (in timestamp counter ticks) to a stage histogram
+ *
+ * @param stage
+ * @param ticks
+ */
+void latency_record(enum lat_stage stage, uint64_t ticks);
+
+/**
+ * @brief Prints count, mean and percentiles of every stage in nanoseconds
+ *
+ * @param f output stream
+ */
+void latency_dump(FILE *f);
+
+static inline uint64_t lat_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return now_ns();
+#endif
+}
+
+/* Called when get_packet returns */
+static inline void lat_begin(void) {
+    if (latency_enabled) {
+        lat_start = lat_last = lat_now();
+    }
+}
+
+/* Closes the current stage */
+static inline void lat_mark(enum lat_stage stage) {
+    if (latency_enabled) {
+        uint64_t now = lat_now();
+        latency_record(stage, now - lat_last);
+        lat_last = now;
+    }
+}
+
+/* Closes the last stage and records the whole path */
+static inline void lat_end(enum lat_stage stage) {
+    if (latency_enabled) {
+        lat_mark(stage);
+        latency_record(LAT_TOTAL, lat_last - lat_start);
+    }
+}
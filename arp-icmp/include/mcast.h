@@ -0,0 +1,53 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include "skel.h"
+
+/*
+ * Static IPv4 multicast forwarding. Routes file, one route per line ('#'
+ * starts a comment):
+ *   <source|*> <group> <iif|any> <oif>[,<oif>...]
+ * An (S,G) route takes precedence over the (*,G) route of the same group.
+ * A packet is accepted only on the route's input interface (a light RPF
+ * check) and is never sent back out of it.
+ *
+ * The packet is replicated without copies: the TTL is decremented once in
+ * the received buffer, then each output interface gets its own Ethernet
+ * header and a reference to that buffer (scatter-gather send). Link-local
+ * groups (224.0.0.0/24) are never forwarded.
+ */
+
+#define MCAST_TABLE_SIZE 1024 /* power of two */
+
+struct mcast_route {
+    uint32_t src;      /* 0 = any (*,G) */
+    uint32_t group;
+    int iif;           /* -1 = any */
+    uint32_t oifs;     /* bitmask of output interfaces */
+    uint64_t packets;
+    int used;
+};
+
+/**
+ * @brief Loads the routes file
+ *
+ * @param filename
+ * @return number of routes, -1 if the file is invalid
+ */
+int mcast_load(const char *filename);
+
+/**
+ * @brief Forwards a multicast packet to the output interfaces of its route.
+ * Once the packet is replicated, output queues may still reference its
+ * (pooled) buffer, so m gets a fresh one.
+ *
+ * @param m received packet
+ */
+void mcast_forward(packet *m);
+
+/**
+ * @brief Prints the routes with their packet counters
+ *
+ * @param f output stream
+ */
+void mcast_dump(FILE *f);
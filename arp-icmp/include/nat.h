@@ -0,0 +1,88 @@
+#pragma once
+#include <stdint.h>
+#include <netinet/ip.h>
+
+/*
+ * Source NAT (masquerade) towards one outside interface.
+ *
+ * Every flow has two keys in the connection-tracking table: the original
+ * tuple, as sent by the inside host, and the reply tuple, as received on the
+ * outside interface. The table uses open addressing over 64-bit slots
+ * (hash tag + flow reference); lookups take no lock and validate the flow
+ * with its sequence counter, while insertions and deletions are serialised
+ * by a spinlock. Flows live in a preallocated pool, so a concurrent reader
+ * never touches freed memory. Idle flows are expired by a one-second timer
+ * wheel.
+ */
+
+#define NAT_DEFAULT_MAX_FLOWS 65536
+#define NAT_WHEEL_SIZE 1024 /* seconds, must exceed every timeout */
+
+#define NAT_TIMEOUT_TCP 600
+#define NAT_TIMEOUT_TCP_CLOSING 10
+#define NAT_TIMEOUT_UDP 120
+#define NAT_TIMEOUT_ICMP 30
+
+#define NAT_PORT_MIN 1024
+#define NAT_PORT_ATTEMPTS 128
+
+struct nat_tuple {
+    uint32_t src;
+    uint32_t dst;
+    uint16_t sport; /* ICMP echo identifier for echo requests */
+    uint16_t dport; /* ICMP echo identifier for echo replies */
+    uint8_t proto;
+    uint8_t pad[3];
+};
+
+struct nat_flow {
+    uint32_t seq;  /* odd while the flow is being written or is free */
+    uint32_t next; /* timer wheel / free list link (index + 1, 0 = none) */
+    struct nat_tuple orig;
+    struct nat_tuple reply;
+    uint64_t last_seen; /* seconds */
+    uint32_t timeout;   /* seconds */
+};
+
+extern int nat_outside;
+
+/**
+ * @brief Enables source NAT
+ *
+ * @param outside_interface interface facing the public network
+ * @param public_addr address used as source of translated packets
+ * @param max_flows connection-tracking capacity
+ */
+void nat_init(int outside_interface, uint32_t public_addr, uint32_t max_flows);
+
+/**
+ * @brief Translates a packet leaving through the outside interface,
+ * creating the flow on its first packet
+ *
+ * @param ip_hdr IP header (checksums are updated incrementally)
+ * @return 0 if translated, -1 if the packet must be dropped
+ */
+int nat_outbound(struct iphdr *ip_hdr);
+
+/**
+ * @brief Reverse-translates a packet received on the outside interface
+ *
+ * @param ip_hdr IP header (checksums are updated incrementally)
+ * @return 1 if translated, 0 if the packet is not addressed to the
+ * public address, -1 if it is but belongs to no flow
+ */
+int nat_inbound(struct iphdr *ip_hdr);
+
+/**
+ * @brief Advances the timer wheel and expires idle flows
+ *
+ * @param now current time (ns)
+ */
+void nat_tick(uint64_t now);
+
+/**
+ * @brief Number of tracked flows
+ *
+ * @return uint32_t
+ */
+uint32_t nat_flow_count(void);
@@ -0,0 +1,95 @@
+#pragma once
+#include <stdint.h>
+#include <linux/if_ether.h>
+#include "skel.h"
+#include "trie.h"
+
+/*
+ * Neighbour (ARP) table. Entries are kept in an open-addressing hash table
+ * keyed by IP. Static entries come from a neighbour file and never expire;
+ * learned entries are reachable for a timeout after the last ARP reply.
+ * Entries that are used, or that are next hops of the routing table when
+ * warm-up is enabled, are re-probed shortly before they expire, so the
+ * forwarding path does not fall back to queueing behind a fresh ARP round
+ * trip.
+ */
+
+#define NEIGH_TABLE_SIZE 1024 /* slots, power of two */
+#define NEIGH_DEFAULT_TIMEOUT 60 /* seconds */
+#define NEIGH_REFRESH 5 /* seconds before expiry when probing starts */
+#define NEIGH_PROBE_INTERVAL 1 /* seconds between probes of one entry */
+
+enum neigh_state {
+    NEIGH_FREE,
+    NEIGH_INCOMPLETE, /* resolution in progress */
+    NEIGH_REACHABLE,
+    NEIGH_STATIC,
+};
+
+struct arp_entry {
+    uint32_t ip;
+    uint8_t mac[ETH_ALEN];
+    uint8_t state;
+    uint8_t flags;      /* NEIGH_F_* */
+    int interface;      /* where the neighbour was learned */
+    uint64_t expires;   /* ns, learned entries only */
+    uint64_t probed;    /* ns, time of the last ARP request */
+};
+
+#define NEIGH_F_USED 1    /* looked up since the last refresh */
+#define NEIGH_F_NEXTHOP 2 /* kept resolved by warm-up */
+
+/**
+ * @brief Sets the lifetime of learned entries
+ *
+ * @param timeout seconds
+ */
+void neigh_init(uint32_t timeout);
+
+/**
+ * @brief Loads static entries ("<ip> <mac>" per line)
+ *
+ * @param filename
+ */
+void parse_arp_table(char *filename);
+
+/**
+ * @brief Finds a usable entry for ip
+ *
+ * @param ip
+ * @param now current time (ns)
+ * @return struct arp_entry* or NULL if unresolved or expired
+ */
+struct arp_entry *neigh_lookup(uint32_t ip, uint64_t now);
+
+/**
+ * @brief Records an ARP reply (static entries are left untouched)
+ *
+ * @param ip sender address
+ * @param mac sender MAC
+ * @param interface receiving interface
+ * @param now current time (ns)
+ */
+void neigh_update(uint32_t ip, uint8_t *mac, int interface, uint64_t now);
+
+/**
+ * @brief Broadcasts an ARP request for ip
+ *
+ * @param ip
+ * @param interface
+ */
+void neigh_probe(uint32_t ip, int interface);
+
+/**
+ * @brief Starts resolving every next hop of the routing table
+ *
+ * @param root routing trie
+ */
+void neigh_warmup(struct trie_node *root);
+
+/**
+ * @brief Re-probes entries close to expiry and retries unresolved next hops
+ *
+ * @param now current time (ns)
+ */
+void neigh_tick(uint64_t now);
@@ -0,0 +1,99 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+
+/*
+ * Next-hop groups with liveness detection. A route with a backup next hop
+ * points to a group shared by every route with the same primary and backup;
+ * the trie returns the group's active member. Group members are probed with
+ * ICMP echo requests every probe interval, BFD style: a member that misses
+ * `multiplier` consecutive intervals is declared down and each group using
+ * it switches to its other member with a single atomic store, without
+ * touching the trie. The primary is restored as soon as it answers again.
+ */
+
+#define NH_MAX_MEMBERS 64
+#define NH_DEFAULT_INTERVAL 100 /* ms between probes */
+#define NH_DEFAULT_MULTIPLIER 3 /* missed probes before a member is down */
+#define NH_PROBE_ID 0x4246      /* echo identifier of our probes */
+
+struct nh_member {
+    uint32_t ip;
+    int interface;
+    int alive;
+    uint16_t seq;
+    uint64_t last_reply; /* ns */
+};
+
+struct nh_group {
+    int member[2];  /* primary, backup (indexes of members) */
+    int active;     /* 0 or 1, switched atomically */
+};
+
+extern struct nh_member nh_members[NH_MAX_MEMBERS];
+
+/**
+ * @brief Sets the probe timing (call before the first group is created)
+ *
+ * @param interval_ms milliseconds between probes
+ * @param multiplier missed probes before a member is declared down
+ */
+void nh_init(uint32_t interval_ms, uint32_t multiplier);
+
+/**
+ * @brief Finds or creates the group for a primary and a backup next hop
+ *
+ * @param primary next hop
+ * @param primary_interface
+ * @param backup next hop
+ * @param backup_interface
+ * @return struct nh_group*
+ */
+struct nh_group *nh_group_get(uint32_t primary, int primary_interface,
+                              uint32_t backup, int backup_interface);
+
+/**
+ * @brief Active next hop of a group
+ *
+ * @param g group
+ * @param next_hop return value
+ * @return int interface
+ */
+static inline int nh_group_active(struct nh_group *g, uint32_t *next_hop) {
+    struct nh_member *m = &nh_members[g->member[__atomic_load_n(&g->active, __ATOMIC_ACQUIRE)]];
+    *next_hop = m->ip;
+    return m->interface;
+}
+
+/**
+ * @brief Whether any group exists, i.e. probing is running
+ *
+ * @return int
+ */
+int nh_enabled(void);
+
+/**
+ * @brief Consumes the echo replies to our probes
+ *
+ * @param ip_hdr
+ * @param icmp_hdr
+ * @param now current time (ns)
+ * @return int 1 if the packet was a probe reply
+ */
+int nh_input(struct iphdr *ip_hdr, struct icmphdr *icmp_hdr, uint64_t now);
+
+/**
+ * @brief Sends due probes and fails groups over when members go down
+ *
+ * @param now current time (ns)
+ */
+void nh_tick(uint64_t now);
+
+/**
+ * @brief Prints members and groups
+ *
+ * @param f
+ */
+void nh_dump(FILE *f);
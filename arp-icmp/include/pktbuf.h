@@ -0,0 +1,45 @@
+#pragma once
+#include "skel.h"
+
+/*
+ * Packet buffer pools. Frames are received into one MTU-sized buffer and are
+ * only copied when they have to be kept (ARP queue, egress queues). The copy
+ * is drawn from the smallest size class that fits, so a queued 64-byte ACK
+ * does not pin a jumbo-sized buffer. Buffers are reference counted, so one
+ * frame can sit in several queues at once; the last pktbuf_free returns it
+ * to a per-class free list.
+ */
+
+#define PKTBUF_CLASSES 4
+#define PKTBUF_CACHE 4096 /* free buffers kept per class */
+
+/**
+ * @brief Allocates a buffer of at least len bytes
+ *
+ * @param len
+ * @return char* buffer (never NULL)
+ */
+char *pktbuf_alloc(int len);
+
+/**
+ * @brief Takes another reference to a buffer
+ *
+ * @param buf buffer from pktbuf_alloc
+ * @return char* buf
+ */
+char *pktbuf_ref(char *buf);
+
+/**
+ * @brief Drops a reference, returning the buffer to its pool with the last
+ *
+ * @param buf buffer from pktbuf_alloc (NULL is ignored)
+ */
+void pktbuf_free(char *buf);
+
+/**
+ * @brief Copies a packet into a pooled buffer sized for it
+ *
+ * @param dst copy (its payload must be released with pktbuf_free)
+ * @param src
+ */
+void pktbuf_clone(packet *dst, const packet *src);
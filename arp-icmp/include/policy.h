@@ -0,0 +1,77 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include "skel.h"
+#include "trie.h"
+
+/*
+ * Policy routing rules file, one rule per line, first match wins ('#' starts
+ * a comment):
+ *   <src>[/len] <iif> <table>
+ * iif is an interface index or any; table is main or a routing table file
+ * (same format as the rtable). Rules naming the same file share the table.
+ *
+ * Rules are compiled into a trie on the source address. Every node keeps,
+ * for each input interface, the first rule with that source prefix, so a
+ * lookup is a single walk of the source address (the first rule on the path
+ * wins) followed by the destination lookup in the selected table, whatever
+ * the number of rules. A destination missing from the selected table falls
+ * back to the main table.
+ */
+
+#define POLICY_MAX_RULES 1024
+#define POLICY_MAX_TABLES 32
+
+struct policy_rule {
+    uint32_t src;
+    uint8_t src_len;
+    int iif;                  /* -1 = any */
+    int table;                /* index in tables, -1 = main */
+    uint64_t hits;
+};
+
+struct policy_node {
+    int16_t rule[ROUTER_NUM_INTERFACES]; /* first rule per iif, -1 = none */
+    struct policy_node *l;
+    struct policy_node *r;
+};
+
+struct policy {
+    struct policy_rule *rules;
+    int n_rules;
+    struct trie_node *tables[POLICY_MAX_TABLES];
+    char *table_names[POLICY_MAX_TABLES];
+    int n_tables;
+    struct policy_node *root;
+};
+
+/**
+ * @brief Compiles a rules file
+ *
+ * @param filename
+ * @param load_table reads a routing table file into a new trie
+ * @return struct policy* or NULL if the file is invalid
+ */
+struct policy *policy_load(const char *filename, struct trie_node *(*load_table)(char *filename));
+
+/**
+ * @brief Routes a packet by source, input interface and destination
+ *
+ * @param p rules
+ * @param main main routing table
+ * @param src source address
+ * @param dst destination address
+ * @param iif input interface
+ * @param next_hop return value if found next hop
+ * @return -1 if not found, corresponding interface otherwise
+ */
+int policy_route(struct policy *p, struct trie_node *main, uint32_t src, uint32_t dst, int iif,
+                 uint32_t *next_hop);
+
+/**
+ * @brief Prints the rules with their hit counters
+ *
+ * @param p
+ * @param f output stream
+ */
+void policy_dump(struct policy *p, FILE *f);
@@ -0,0 +1,140 @@
+#pragma once
+#include <stdint.h>
+#include "skel.h"
+
+/* Tokens are kept scaled so that refills need no floating point */
+#define TB_SCALE 1000000000ULL
+
+#define ICMP_DEFAULT_RATE 1000
+#define ICMP_DEFAULT_BURST 50
+#define ICMP_DEFAULT_IF_RATE 200
+#define ICMP_DEFAULT_IF_BURST 20
+
+struct token_bucket {
+    uint64_t rate;   /* tokens per second, 0 means unlimited */
+    uint64_t burst;  /* bucket depth in tokens */
+    uint64_t tokens; /* current fill, scaled by TB_SCALE */
+    uint64_t last;   /* time of the last refill (ns) */
+};
+
+enum icmp_class {
+    ICMP_CLASS_TIME_EXCEEDED,
+    ICMP_CLASS_DEST_UNREACH,
+    ICMP_CLASS_ECHO_REPLY,
+    ICMP_CLASS_MAX
+};
+
+/*
+ * Control-plane policing: traffic addressed to the router (ARP for its
+ * address, IP to its address or to the RIP group) is classified by protocol
+ * and must take a token from its class bucket and from one of
+ * COPP_SRC_BUCKETS per-source buckets picked by hashing the sender, so a
+ * single flooding host exhausts its own bucket before the class budget.
+ * Excess is dropped before any reply is built.
+ */
+#define COPP_SRC_BUCKETS 1024 /* per class, power of two */
+
+enum copp_class {
+    COPP_ICMP,
+    COPP_ARP,
+    COPP_RIP,
+    COPP_OTHER, /* any other IP protocol to the router */
+    COPP_CLASS_MAX
+};
+
+extern const char *icmp_class_names[ICMP_CLASS_MAX];
+extern const char *copp_class_names[COPP_CLASS_MAX];
+
+/**
+ * @brief Initialises a full token bucket
+ *
+ * @param tb bucket
+ * @param rate tokens per second (0 = unlimited)
+ * @param burst maximum number of tokens
+ */
+void tb_init(struct token_bucket *tb, uint64_t rate, uint64_t burst);
+
+/**
+ * @brief Adds the tokens earned since the last refill
+ *
+ * @param tb bucket
+ * @param now current time (ns)
+ */
+void tb_refill(struct token_bucket *tb, uint64_t now);
+
+/**
+ * @brief Takes one token from the bucket
+ *
+ * @param tb bucket
+ * @param now current time (ns)
+ * @return 1 if a token was available, 0 otherwise
+ */
+int tb_consume(struct token_bucket *tb, uint64_t now);
+
+/**
+ * @brief Configures the ICMP limiter (global and per-interface buckets)
+ *
+ * @param rate global messages per second for each ICMP class
+ * @param burst global burst
+ * @param if_rate per-interface messages per second for each ICMP class
+ * @param if_burst per-interface burst
+ */
+void icmp_limit_init(uint64_t rate, uint64_t burst, uint64_t if_rate, uint64_t if_burst);
+
+/**
+ * @brief Checks whether an ICMP message may be generated on interface.
+ * A token is taken from both the interface and the global bucket, or from
+ * neither; refused messages are counted as suppressed.
+ *
+ * @param cls ICMP class
+ * @param interface egress interface of the ICMP message
+ * @return 1 if the message may be sent, 0 if it must be suppressed
+ */
+int icmp_limit_allow(enum icmp_class cls, int interface);
+
+/**
+ * @brief Number of messages suppressed so far by the calling thread
+ *
+ * @param cls ICMP class
+ * @param interface interface
+ * @return uint64_t suppressed messages
+ */
+uint64_t icmp_limit_suppressed(enum icmp_class cls, int interface);
+
+/**
+ * @brief Sets the class and per-source policers of one class (the defaults
+ * are set by copp_init)
+ *
+ * @param cls class
+ * @param rate class packets per second (0 = unlimited)
+ * @param burst class burst
+ * @param src_rate packets per second of each source bucket (0 = unlimited)
+ * @param src_burst source burst
+ */
+void copp_set(enum copp_class cls, uint64_t rate, uint64_t burst, uint64_t src_rate,
+              uint64_t src_burst);
+
+/**
+ * @brief Parses "class=rate/burst[,...]" (class may be all) into copp_set
+ *
+ * @param spec
+ * @param per_source whether the values are for the source buckets
+ * @return 0 or -1 if spec is invalid
+ */
+int copp_parse(char *spec, int per_source);
+
+/**
+ * @brief Installs the default policers; call before copp_set/copp_parse
+ */
+void copp_init(void);
+
+/**
+ * @brief Polices a frame if it is addressed to the router. Transit frames
+ * always pass.
+ *
+ * @param frame Ethernet frame
+ * @param len
+ * @param router_addr address of the receiving interface
+ * @return 1 if the frame may be processed, 0 if it must be dropped
+ */
+int copp_allow(const char *frame, int len, uint32_t router_addr);
@@ -0,0 +1,118 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <netinet/ip.h>
+#include "skel.h"
+#include "trie.h"
+
+/*
+ * RIPv2 (RFC 2453) between router instances. Routes of the rtable are
+ * advertised with metric 1; routes learned from neighbours are kept in a
+ * RIB hashed by prefix and mirrored into the forwarding trie one prefix at a
+ * time. Updates go to 224.0.0.9 on every running interface, with split
+ * horizon. Changes are sent at once as triggered updates (at most one per
+ * RIP_TRIGGER_HOLD); a full table follows every interval. An interface that
+ * loses carrier immediately withdraws the routes learned through it.
+ */
+
+#define RIP_PORT 520
+#define RIP_GROUP 0xe0000009 /* 224.0.0.9, host order */
+#define RIP_VERSION 2
+#define RIP_REQUEST 1
+#define RIP_RESPONSE 2
+#define RIP_INFINITY 16
+#define RIP_MAX_ENTRIES 25 /* routes per message */
+#define RIP_BUCKETS 65536
+
+#define RIP_DEFAULT_INTERVAL 30 /* seconds between full updates */
+#define RIP_TIMEOUT_INTERVALS 6 /* a learned route expires after 180s */
+#define RIP_GARBAGE_INTERVALS 4 /* and is advertised unreachable for 120s */
+#define RIP_TRIGGER_HOLD 1      /* seconds between triggered updates */
+
+struct rip_header {
+    uint8_t command;
+    uint8_t version;
+    uint16_t zero;
+} __attribute__((packed));
+
+struct rip_entry {
+    uint16_t family;
+    uint16_t tag;
+    uint32_t addr;
+    uint32_t mask;
+    uint32_t next_hop;
+    uint32_t metric;
+} __attribute__((packed));
+
+enum rip_source {
+    RIP_STATIC,  /* from the rtable, never replaced */
+    RIP_LEARNED,
+};
+
+struct rip_route {
+    struct rip_route *hash_next;
+    struct rip_route *list_next;
+    uint32_t prefix;
+    uint32_t mask;
+    uint32_t next_hop;
+    int interface;
+    uint8_t metric;
+    uint8_t source;
+    uint8_t changed;  /* to be sent in the next triggered update */
+    uint64_t timeout; /* ns, learned routes */
+    uint64_t garbage; /* ns, 0 while the route is reachable */
+};
+
+extern int rip_enabled;
+
+/**
+ * @brief Records a route of the rtable (call before rip_init)
+ *
+ * @param prefix
+ * @param mask
+ * @param next_hop
+ * @param interface
+ */
+void rip_static(uint32_t prefix, uint32_t mask, uint32_t next_hop, int interface);
+
+/**
+ * @brief Starts the protocol: asks the neighbours for their tables and
+ * advertises ours
+ *
+ * @param root forwarding trie updated with learned routes
+ * @param interval seconds between full updates
+ */
+void rip_init(struct trie_node *root, uint32_t interval);
+
+/**
+ * @brief Checks whether a packet is a RIP message for this router
+ *
+ * @param ip_hdr
+ * @param router_addr address of the receiving interface
+ * @return int 1 if it is
+ */
+int rip_match(struct iphdr *ip_hdr, uint32_t router_addr);
+
+/**
+ * @brief Processes a RIP request or response
+ *
+ * @param ip_hdr
+ * @param interface receiving interface
+ * @param now current time (ns)
+ */
+void rip_input(struct iphdr *ip_hdr, int interface, uint64_t now);
+
+/**
+ * @brief Sends periodic and triggered updates, expires routes and watches
+ * the link state of the interfaces
+ *
+ * @param now current time (ns)
+ */
+void rip_tick(uint64_t now);
+
+/**
+ * @brief Prints the RIB
+ *
+ * @param f
+ */
+void rip_dump(FILE *f);
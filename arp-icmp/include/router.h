@@ -3,25 +3,24 @@
 #include <netinet/ip.h>
 #include <linux/if_ether.h>
 #include "skel.h"
+#include "neigh.h"
 
-#define MAX_TABLE_SIZE 100
+#define ARP_QUEUE_MAX 256 // packets waiting for ARP replies
 
-struct arp_entry {
-	uint32_t ip;
-	uint8_t mac[ETH_ALEN];
-};
+#define ROUTER_TICK_MS 1000 // housekeeping period when idle
 
 struct queue_entry {
 	packet m;
 	int interface;
+	uint32_t next_hop;
 };
 
 /**
  * @brief Get the arp entry object
  *
  * @param dest_ip
- * @return Returns a pointer (eg. &arp_table[i]) to the best matching ARP entry.
- for the given dest_ip or NULL if there is no matching entry.
+ * @return Returns a pointer to the neighbour entry for the given dest_ip
+ or NULL if it is not resolved (or has expired).
  */
 struct arp_entry *get_arp_entry(uint32_t dest_ip);
 
@@ -35,7 +34,20 @@ struct arp_entry *get_arp_entry(uint32_t dest_ip);
 int get_best_route(uint32_t dest_ip, uint32_t *next_hop);
 
 /**
- * @brief Reads the routing table from text file
+ * @brief Returns the route interface chosen by the policy rules for a packet
+ * from src_ip received on interface (the main table if there are no rules)
+ *
+ * @param src_ip
+ * @param dest_ip
+ * @param interface input interface
+ * @param next_hop return value if next hop found
+ * @return interface or -1 if not found
+ */
+int get_policy_route(uint32_t src_ip, uint32_t dest_ip, int interface, uint32_t *next_hop);
+
+/**
+ * @brief Reads the routing table from text file, then the policy rules and
+ * the tables they refer to
  *
  * @param rtable
  * @param filename
@@ -43,7 +55,42 @@ int get_best_route(uint32_t dest_ip, uint32_t *next_hop);
 void read_rtable(char* filename);
 
 /**
- * @brief Updates ethernet header and sends packet
+ * @brief Parses command line options and configures the router modules
+ *
+ * @param argc
+ * @param argv
+ * @return index of the first positional argument (rtable)
+ */
+int parse_options(int argc, char *argv[]);
+
+/**
+ * @brief Periodic work: expires NAT flows, refreshes ARP entries and runs
+ * the RIP timers and next-hop probes and exports sampled flows
+ *
+ * @param now current time (ns)
+ */
+void router_tick(uint64_t now);
+
+/**
+ * @brief Services the requests signalled since the last call:
+ * SIGUSR1 dumps latency histograms, ACL, policy and multicast counters, RIP
+ * routes and next hops, SIGHUP reloads the ACL, SIGUSR2 starts or stops the
+ * capture
+ */
+void handle_signals(void);
+
+/**
+ * @brief Splits an IP packet into fragments that fit mtu and sends them
+ *
+ * @param m packet (Ethernet header already rewritten)
+ * @param interface to be sent to
+ * @param mtu egress MTU
+ */
+void send_fragments(packet *m, int interface, int mtu);
+
+/**
+ * @brief Updates ethernet header and sends packet (fragmented if it exceeds
+ * the interface MTU)
  *
  * @param m packet
  * @param interface to be sent to
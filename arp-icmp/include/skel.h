@@ -26,11 +26,13 @@
 #include <asm/byteorder.h>
 
 /* 
- *Note that "buffer" should be at least the MTU size of the 
- * interface, eg 1500 bytes 
+ * Largest MTU the router forwards; the receive buffer holds a frame of
+ * this MTU plus its Ethernet header
  */
-#define MAX_LEN 1600
+#define MAX_MTU 9216
+#define MAX_LEN (MAX_MTU + ETH_HLEN)
 #define ROUTER_NUM_INTERFACES 3
+#define RX_DEFAULT_BURST 8 /* packets read from an interface per round */
 
 #define DIE(condition, message) \
 	do { \
@@ -43,8 +45,9 @@
 
 typedef struct {
 	int len;
-	char payload[MAX_LEN];
+	char *payload; /* caller-owned, at least MAX_LEN bytes for get_packet */
 	int interface;
+	int csum_valid; /* the checksums are known good (kernel auxdata) */
 } packet;
 
 /* Ethernet ARP packet from RFC 826 */
@@ -71,13 +74,41 @@ extern int interfaces[ROUTER_NUM_INTERFACES];
  */
 int send_packet(int interface, packet *m);
 /**
- * @brief Get the packet object
+ * @brief Get the packet object. Readable interfaces are served round robin,
+ * at most their RX burst per round.
  * 
  * @param m 
- * @return int 
+ * @return int 0 on success, -1 with errno set to EINTR if interrupted by a signal
+ * or to ETIMEDOUT if nothing arrived within the RX timeout
  */
 int get_packet(packet *m);
 
+/**
+ * @brief Bounds how long get_packet waits for a packet
+ * 
+ * @param ms milliseconds, 0 waits forever
+ */
+void set_rx_timeout(int ms);
+
+/**
+ * @brief Sets how many packets get_packet reads from interface before
+ * moving to the next readable one (its weight in the RX round robin)
+ * 
+ * @param interface 
+ * @param burst 
+ */
+void set_rx_burst(int interface, int burst);
+
+/**
+ * @brief Switches get_packet to polling: interfaces are drained with
+ * non-blocking reads in a loop and select is only used to sleep after
+ * spin_us without any packet. Also asks the kernel to busy poll the
+ * sockets (SO_BUSY_POLL) where it supports it. Call after init.
+ * 
+ * @param spin_us idle time before sleeping, in microseconds
+ */
+void set_rx_busy_poll(int spin_us);
+
 /**
  * @brief Get the interface ip object
  * 
@@ -86,6 +117,14 @@ int get_packet(packet *m);
  */
 char *get_interface_ip(int interface);
 
+/**
+ * @brief Checks the link state of the interface
+ * 
+ * @param interface 
+ * @return int 1 if the interface is up and has carrier, 0 otherwise
+ */
+int get_interface_running(int interface);
+
 /**
  * @brief Get the interface mac object
  * 
@@ -103,10 +142,12 @@ void get_interface_mac(int interface, uint8_t *mac);
 void init(int argc, char *argv[]);
 
 /**
- * @brief 
+ * @brief Get the interface MTU (read once by init)
  * 
+ * @param interface 
+ * @return int MTU in bytes, capped at MAX_MTU
  */
-void parse_arp_table();
+int get_interface_mtu(int interface);
 
 /**
  * @brief 
@@ -137,6 +178,20 @@ void send_icmp(uint32_t daddr, uint32_t saddr, uint8_t *sha, uint8_t *dha, u_int
  */
 void send_icmp_error(uint32_t daddr, uint32_t saddr, uint8_t *sha, uint8_t *dha, u_int8_t type, u_int8_t code, int interface);
 
+/**
+ * @brief Sends ICMP destination unreachable / fragmentation needed, quoting
+ * the offending header and the first 8 bytes of its payload
+ * 
+ * @param daddr destination IP
+ * @param saddr source IP
+ * @param sha source MAC
+ * @param dha destination MAC
+ * @param orig IP header of the packet that does not fit
+ * @param mtu next-hop MTU
+ * @param interface interface 
+ */
+void send_icmp_frag_needed(uint32_t daddr, uint32_t saddr, uint8_t *sha, uint8_t *dha, struct iphdr *orig, int mtu, int interface);
+
 
 /**
  * @brief 
@@ -0,0 +1,98 @@
+#pragma once
+#include <stdint.h>
+#include <sys/types.h>
+#include <net/if.h>
+#include "egress.h"
+#include "ratelimit.h"
+#include "skel.h"
+
+#define CACHE_LINE 64
+#define STATS_MAX_THREADS 8
+#define STATS_MAGIC 0x52535431 /* "RST1" */
+#define STATS_VERSION 3
+#define STATS_NAME_FORMAT "/router-stats.%d"
+
+enum drop_reason {
+    DROP_BAD_CHECKSUM,
+    DROP_NO_ROUTE,
+    DROP_TTL,
+    DROP_ARP_QUEUE_FULL,
+    DROP_TX_ERROR,
+    DROP_ACL,
+    DROP_NAT,
+    DROP_MTU,
+    DROP_MAX
+};
+
+struct if_counters {
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+};
+
+/* Written only by the owning thread, read concurrently by routerstat */
+struct thread_stats {
+    struct if_counters ifs[ROUTER_NUM_INTERFACES];
+    uint64_t drops[DROP_MAX];
+    uint64_t icmp_suppressed[ROUTER_NUM_INTERFACES][ICMP_CLASS_MAX];
+    uint64_t egress_drops[ROUTER_NUM_INTERFACES][EGRESS_CLASSES];
+    uint64_t csum_offloaded; /* IP checksums trusted from the kernel */
+    uint64_t csum_software;  /* IP checksums verified by the router */
+    uint64_t copp_passed[COPP_CLASS_MAX];
+    uint64_t copp_dropped[COPP_CLASS_MAX];
+} __attribute__((aligned(CACHE_LINE)));
+
+/* Layout of the shared memory segment */
+struct stats_segment {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n_threads;
+    uint32_t n_interfaces;
+    pid_t pid;
+    char if_names[ROUTER_NUM_INTERFACES][IFNAMSIZ];
+    struct thread_stats threads[STATS_MAX_THREADS];
+};
+
+/* Counters of the calling thread */
+extern __thread struct thread_stats *stats;
+
+extern const char *drop_reason_names[DROP_MAX];
+
+/**
+ * @brief Creates the shared memory segment and registers the calling thread.
+ * Falls back to private memory if the segment cannot be created, so the
+ * data path never has to check whether statistics are enabled.
+ *
+ * @param name segment name (NULL for the default, STATS_NAME_FORMAT with pid)
+ * @param if_names interface names
+ * @param n_interfaces number of interfaces
+ */
+void stats_init(const char *name, char *if_names[], int n_interfaces);
+
+/**
+ * @brief Reserves a counter block for the calling thread
+ */
+void stats_register_thread(void);
+
+static inline void stats_rx(int interface, int len) {
+    stats->ifs[interface].rx_packets++;
+    stats->ifs[interface].rx_bytes += len;
+}
+
+static inline void stats_tx(int interface, int len) {
+    stats->ifs[interface].tx_packets++;
+    stats->ifs[interface].tx_bytes += len;
+}
+
+static inline void stats_drop(enum drop_reason reason) {
+    stats->drops[reason]++;
+}
+
+static inline void stats_csum(int offloaded) {
+    if (offloaded) {
+        stats->csum_offloaded++;
+    } else {
+        stats->csum_software++;
+    }
+}
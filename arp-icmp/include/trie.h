@@ -1,9 +1,25 @@
 #pragma once
 #include <arpa/inet.h>
 
+struct nh_group;
+
+#define TRIE_SPLIT_BITS 8 /* bulk build: one subtrie per value of the top bits */
+#define TRIE_PARTITIONS (1 << TRIE_SPLIT_BITS)
+#define TRIE_MAX_THREADS 64
+
+/* A route to bulk load, addresses in network order */
+struct trie_route {
+    uint32_t prefix;
+    uint32_t mask;
+    uint32_t next_hop;
+    int interface;
+    struct nh_group *group; /* primary/backup pair, or NULL */
+};
+
 struct trie_node {
     int interface;
     uint32_t next_hop;
+    struct nh_group *group; /* primary/backup pair, overrides next_hop */
     struct trie_node *l;
     struct trie_node *r;
 };
@@ -51,6 +67,26 @@ int get_bit_count_from_mask(uint32_t mask);
  */
 void insert_route(struct trie_node *root, uint32_t prefix, uint32_t mask, uint32_t next_hop, int interface);
 
+/**
+ * @brief Inserts a route whose next hop is chosen by a next-hop group
+ *
+ * @param root of trie
+ * @param prefix
+ * @param mask
+ * @param group
+ */
+void insert_route_group(struct trie_node *root, uint32_t prefix, uint32_t mask, struct nh_group *group);
+
+/**
+ * @brief Removes the route of prefix/mask, freeing the nodes it no longer needs
+ *
+ * @param root of trie
+ * @param prefix
+ * @param mask
+ * @return 1 if a route was removed, 0 if there was none
+ */
+int delete_route(struct trie_node *root, uint32_t prefix, uint32_t mask);
+
 /**
  * @brief Searches for best match in trie
  *
@@ -61,3 +97,15 @@ void insert_route(struct trie_node *root, uint32_t prefix, uint32_t mask, uint32
  */
 int search_route(struct trie_node *root, uint32_t ip, uint32_t *next_hop);
 
+/**
+ * @brief Builds a trie from a whole table at once. Routes are partitioned by
+ * their top TRIE_SPLIT_BITS bits and the subtries are built concurrently,
+ * then stitched under the top levels. A later route for the same prefix
+ * replaces an earlier one, as with insert_route.
+ *
+ * @param routes
+ * @param n number of routes
+ * @param threads builder threads (including the caller)
+ * @return root of the new trie
+ */
+struct trie_node *build_trie(struct trie_route *routes, int n, int threads);
@@ -0,0 +1,90 @@
+#include "latency.h"
+
+int latency_enabled;
+uint64_t lat_start, lat_last;
+
+static struct lat_histogram histograms[LAT_STAGE_MAX];
+static double ticks_per_ns = 1.0;
+
+static const char *stage_names[LAT_STAGE_MAX] = {
+    [LAT_CLASSIFY] = "classify",
+    [LAT_LPM] = "lpm",
+    [LAT_NEIGH] = "neighbor",
+    [LAT_TX] = "tx",
+    [LAT_TOTAL] = "total",
+};
+
+static int bucket_index(uint64_t value) {
+    if (value < 2 * LAT_SUB_COUNT) {
+        return value;
+    }
+
+    int shift = 63 - __builtin_clzll(value) - LAT_SUB_BITS;
+    return (shift + 1) * LAT_SUB_COUNT + (int)((value >> shift) - LAT_SUB_COUNT);
+}
+
+static uint64_t bucket_value(int index) {
+    if (index < 2 * LAT_SUB_COUNT) {
+        return index;
+    }
+
+    int shift = index / LAT_SUB_COUNT - 1;
+    return (uint64_t)(index % LAT_SUB_COUNT + LAT_SUB_COUNT) << shift;
+}
+
+void latency_init(void) {
+    latency_enabled = 1;
+
+#if defined(__x86_64__) || defined(__i386__)
+    // Measure the timestamp counter against the monotonic clock
+    uint64_t t0 = now_ns(), c0 = lat_now();
+    struct timespec ts = {0, 20 * NSEC_PER_MSEC};
+    nanosleep(&ts, NULL);
+    uint64_t t1 = now_ns(), c1 = lat_now();
+    ticks_per_ns = (double)(c1 - c0) / (t1 - t0);
+#endif
+    printf("Latency histograms enabled (%.3f ticks/ns)\n", ticks_per_ns);
+}
+
+void latency_record(enum lat_stage stage, uint64_t ticks) {
+    struct lat_histogram *h = &histograms[stage];
+
+    h->count++;
+    h->sum += ticks;
+    if (ticks > h->max) {
+        h->max = ticks;
+    }
+    h->buckets[bucket_index(ticks)]++;
+}
+
+/* Smallest recorded value such that fraction q of the samples are below it */
+static uint64_t percentile(struct lat_histogram *h, double q) {
+    uint64_t target = q * h->count, seen = 0;
+
+    for (int i = 0; i < LAT_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > target) {
+            return bucket_value(i);
+        }
+    }
+    return h->max;
+}
+
+void latency_dump(FILE *f) {
+    fprintf(f, "%-10s %12s %10s %10s %10s %10s %10s %10s\n", "stage(ns)", "count", "mean",
+            "p50", "p90", "p99", "p99.9", "max");
+
+    for (int s = 0; s < LAT_STAGE_MAX; s++) {
+        struct lat_histogram *h = &histograms[s];
+        if (h->count == 0) {
+            fprintf(f, "%-10s %12d\n", stage_names[s], 0);
+            continue;
+        }
+
+        fprintf(f, "%-10s %12lu %10.0f %10.0f %10.0f %10.0f %10.0f %10.0f\n", stage_names[s],
+                h->count, h->sum / ticks_per_ns / h->count,
+                percentile(h, 0.5) / ticks_per_ns, percentile(h, 0.9) / ticks_per_ns,
+                percentile(h, 0.99) / ticks_per_ns, percentile(h, 0.999) / ticks_per_ns,
+                h->max / ticks_per_ns);
+    }
+}
@@ -0,0 +1,203 @@
+#include "mcast.h"
+#include <arpa/inet.h>
+#include <string.h>
+#include "egress.h"
+#include "pktbuf.h"
+#include "router.h"
+#include "stats.h"
+
+static struct mcast_route table[MCAST_TABLE_SIZE];
+static int n_routes;
+
+static uint32_t mcast_hash(uint32_t src, uint32_t group) {
+    return ((src ^ group) * 0x9e3779b1u) >> 22; // top log2(MCAST_TABLE_SIZE) bits
+}
+
+/* Slot holding (src, group), or the free slot where it belongs (NULL if full) */
+static struct mcast_route *mcast_slot(uint32_t src, uint32_t group) {
+    uint32_t h = mcast_hash(src, group);
+
+    for (int i = 0; i < MCAST_TABLE_SIZE; i++) {
+        struct mcast_route *r = &table[(h + i) & (MCAST_TABLE_SIZE - 1)];
+        if (!r->used || (r->src == src && r->group == group)) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+static struct mcast_route *mcast_lookup(uint32_t src, uint32_t group) {
+    struct mcast_route *r = mcast_slot(src, group);
+    if (r != NULL && r->used) {
+        return r;
+    }
+    r = mcast_slot(0, group);
+    return r != NULL && r->used ? r : NULL;
+}
+
+static int parse_route(char *line, struct mcast_route *route) {
+    char src[32], group[32], iif[16], oifs[64];
+    struct in_addr in;
+
+    memset(route, 0, sizeof(*route));
+    if (sscanf(line, "%31s %31s %15s %63s", src, group, iif, oifs) != 4) {
+        return -1;
+    }
+
+    if (strcmp(src, "*") != 0) {
+        if (inet_aton(src, &in) == 0) {
+            return -1;
+        }
+        route->src = in.s_addr;
+    }
+    if (inet_aton(group, &in) == 0 || !IN_MULTICAST(ntohl(in.s_addr))) {
+        return -1;
+    }
+    route->group = in.s_addr;
+
+    if (strcmp(iif, "any") == 0) {
+        route->iif = -1;
+    } else {
+        char *end;
+        route->iif = strtol(iif, &end, 10);
+        if (*end != '\0' || route->iif < 0 || route->iif >= ROUTER_NUM_INTERFACES) {
+            return -1;
+        }
+    }
+
+    for (char *tok = strtok(oifs, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        char *end;
+        int oif = strtol(tok, &end, 10);
+        if (*end != '\0' || oif < 0 || oif >= ROUTER_NUM_INTERFACES) {
+            return -1;
+        }
+        route->oifs |= 1u << oif;
+    }
+    return 0;
+}
+
+int mcast_load(const char *filename) {
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        perror(filename);
+        return -1;
+    }
+
+    int lineno = 0;
+    char line[256];
+
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+
+        char *comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+        if (strspn(line, " \t\r\n") == strlen(line)) {
+            continue;
+        }
+
+        struct mcast_route route;
+        struct mcast_route *slot = NULL;
+        if (parse_route(line, &route) < 0 ||
+            (slot = mcast_slot(route.src, route.group)) == NULL || slot->used) {
+            fprintf(stderr, "%s:%d: %s multicast route\n", filename, lineno,
+                    slot != NULL && slot->used ? "duplicate" : "invalid");
+            fclose(f);
+            return -1;
+        }
+        route.used = 1;
+        *slot = route;
+        n_routes++;
+    }
+    fclose(f);
+
+    printf("Multicast: %d routes\n", n_routes);
+    return n_routes;
+}
+
+void mcast_forward(packet *m) {
+    struct ether_header *eth_hdr = (struct ether_header *)m->payload;
+    struct iphdr *ip_hdr = (struct iphdr *)(m->payload + sizeof(struct ether_header));
+    uint32_t group = ntohl(ip_hdr->daddr);
+
+    // Link-local groups never leave the link
+    if ((group & 0xffffff00) == 0xe0000000) {
+        return;
+    }
+
+    struct mcast_route *route = mcast_lookup(ip_hdr->saddr, ip_hdr->daddr);
+    if (route == NULL || (route->iif != -1 && route->iif != m->interface)) {
+        printf("No multicast route\n");
+        stats_drop(DROP_NO_ROUTE);
+        return;
+    }
+
+    // No ICMP errors for multicast (RFC 1812 4.3.2.7)
+    if (ip_hdr->ttl <= 1) {
+        stats_drop(DROP_TTL);
+        return;
+    }
+    ip_hdr->ttl--;
+    ip_hdr->check = ip_checksum_incremental(ip_hdr->check, ip_hdr->ttl + 1, ip_hdr->ttl);
+    route->packets++;
+
+    // 01:00:5e followed by the low 23 bits of the group (RFC 1112)
+    struct ether_header l2 = {
+        .ether_dhost = { 0x01, 0x00, 0x5e, (group >> 16) & 0x7f, group >> 8, group },
+        .ether_type = eth_hdr->ether_type,
+    };
+
+    int copies = 0;
+    for (int oif = 0; oif < ROUTER_NUM_INTERFACES; oif++) {
+        if (!(route->oifs & (1u << oif)) || oif == m->interface) {
+            continue;
+        }
+        if (m->len - (int)sizeof(struct ether_header) > get_interface_mtu(oif)) {
+            stats_drop(DROP_MTU);
+            continue;
+        }
+        get_interface_mac(oif, l2.ether_shost);
+        if (egress_send_shared(oif, &l2, m->payload, m->len) >= 0) {
+            copies++;
+        }
+    }
+    printf("Multicast forwarded to %d interfaces\n", copies);
+
+    // Queued copies hold their own references; the receive path gets a
+    // fresh buffer
+    pktbuf_free(m->payload);
+    m->payload = pktbuf_alloc(MAX_LEN);
+}
+
+void mcast_dump(FILE *f) {
+    fprintf(f, "Multicast routes (%d)\n", n_routes);
+
+    for (int i = 0; i < MCAST_TABLE_SIZE; i++) {
+        struct mcast_route *r = &table[i];
+        if (!r->used) {
+            continue;
+        }
+
+        char src[INET_ADDRSTRLEN], group[INET_ADDRSTRLEN], iif[16], oifs[64] = "";
+        if (r->src == 0) {
+            snprintf(src, sizeof(src), "*");
+        } else {
+            inet_ntop(AF_INET, &r->src, src, sizeof(src));
+        }
+        inet_ntop(AF_INET, &r->group, group, sizeof(group));
+        if (r->iif == -1) {
+            snprintf(iif, sizeof(iif), "any");
+        } else {
+            snprintf(iif, sizeof(iif), "%d", r->iif);
+        }
+        for (int oif = 0; oif < ROUTER_NUM_INTERFACES; oif++) {
+            if (r->oifs & (1u << oif)) {
+                snprintf(oifs + strlen(oifs), sizeof(oifs) - strlen(oifs), "%s%d",
+                         oifs[0] != '\0' ? "," : "", oif);
+            }
+        }
+
+        fprintf(f, "(%s,%s) iif %s oif %s: %lu\n", src, group, iif, oifs, r->packets);
+    }
+}
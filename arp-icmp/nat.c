@@ -0,0 +1,435 @@
+#include "nat.h"
+#include <netinet/ip_icmp.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include "router.h"
+#include "timeutil.h"
+
+#define SLOT_EMPTY 0
+#define SLOT_TOMBSTONE 1
+#define SLOT_TAG(h) ((h) & 0xffffffff00000000ULL)
+
+#define DIR_ORIG 0
+#define DIR_REPLY 1
+
+int nat_outside = -1;
+static uint32_t public_addr;
+
+static struct nat_flow *flows;
+static uint32_t n_flows;
+static uint32_t free_head, free_tail; /* index + 1, 0 = none */
+
+static uint64_t *table;
+static uint64_t table_mask;
+
+static uint32_t wheel[NAT_WHEEL_SIZE];
+static uint64_t wheel_time;
+
+static uint32_t port_cursor;
+static int ct_lock;
+
+static void ct_write_lock(void) {
+    while (__atomic_test_and_set(&ct_lock, __ATOMIC_ACQUIRE)) {
+        // writers only hold the lock for a few table updates
+    }
+}
+
+static void ct_write_unlock(void) {
+    __atomic_clear(&ct_lock, __ATOMIC_RELEASE);
+}
+
+static uint64_t tuple_hash(const struct nat_tuple *t) {
+    uint64_t a, b;
+    memcpy(&a, t, sizeof(a));
+    memcpy(&b, (const char *)t + sizeof(a), sizeof(b));
+
+    uint64_t h = a * 0x9E3779B97F4A7C15ULL ^ b;
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 32;
+    return h;
+}
+
+/* A slot holds the upper half of the hash and the flow reference (+2) */
+static uint64_t make_slot(uint64_t hash, uint32_t index, int dir) {
+    return SLOT_TAG(hash) | (((uint64_t)index << 1 | dir) + 2);
+}
+
+/* Lock-free lookup, returns the flow index or -1 */
+static int64_t ct_lookup(const struct nat_tuple *key, int *dir) {
+    uint64_t h = tuple_hash(key);
+
+    for (uint64_t i = h & table_mask, n = 0; n <= table_mask; i = (i + 1) & table_mask, n++) {
+        uint64_t slot = __atomic_load_n(&table[i], __ATOMIC_ACQUIRE);
+        if (slot == SLOT_EMPTY) {
+            return -1;
+        }
+        if (slot == SLOT_TOMBSTONE || SLOT_TAG(slot) != SLOT_TAG(h)) {
+            continue;
+        }
+
+        uint32_t ref = (uint32_t)slot - 2;
+        struct nat_flow *f = &flows[ref >> 1];
+        int d = ref & 1;
+        int match;
+        uint32_t seq;
+
+        // Seqlock read: the flow may be recycled while we compare
+        do {
+            seq = __atomic_load_n(&f->seq, __ATOMIC_ACQUIRE);
+            match = (seq & 1) == 0 &&
+                    memcmp(d == DIR_ORIG ? &f->orig : &f->reply, key, sizeof(*key)) == 0;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while (__atomic_load_n(&f->seq, __ATOMIC_RELAXED) != seq);
+
+        if (match) {
+            *dir = d;
+            return ref >> 1;
+        }
+    }
+    return -1;
+}
+
+static void slot_insert(uint64_t hash, uint64_t value) {
+    for (uint64_t i = hash & table_mask;; i = (i + 1) & table_mask) {
+        if (table[i] == SLOT_EMPTY || table[i] == SLOT_TOMBSTONE) {
+            __atomic_store_n(&table[i], value, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+}
+
+static void slot_remove(uint64_t hash, uint64_t value) {
+    uint64_t i = hash & table_mask;
+    while (table[i] != value) {
+        i = (i + 1) & table_mask;
+    }
+
+    if (table[(i + 1) & table_mask] != SLOT_EMPTY) {
+        __atomic_store_n(&table[i], SLOT_TOMBSTONE, __ATOMIC_RELEASE);
+        return;
+    }
+
+    // End of a probe chain: the tombstones before it are no longer needed
+    do {
+        __atomic_store_n(&table[i], SLOT_EMPTY, __ATOMIC_RELEASE);
+        i = (i - 1) & table_mask;
+    } while (table[i] == SLOT_TOMBSTONE);
+}
+
+static void wheel_add(uint32_t index) {
+    struct nat_flow *f = &flows[index];
+    uint64_t bucket = (__atomic_load_n(&f->last_seen, __ATOMIC_RELAXED) + f->timeout) %
+                      NAT_WHEEL_SIZE;
+
+    f->next = wheel[bucket];
+    wheel[bucket] = index + 1;
+}
+
+/* Freed flows are reused in FIFO order, long after readers let go of them */
+static void flow_free(uint32_t index) {
+    struct nat_flow *f = &flows[index];
+
+    slot_remove(tuple_hash(&f->orig), make_slot(tuple_hash(&f->orig), index, DIR_ORIG));
+    slot_remove(tuple_hash(&f->reply), make_slot(tuple_hash(&f->reply), index, DIR_REPLY));
+    __atomic_store_n(&f->seq, f->seq + 1, __ATOMIC_RELEASE);
+
+    f->next = 0;
+    if (free_tail != 0) {
+        flows[free_tail - 1].next = index + 1;
+    } else {
+        free_head = index + 1;
+    }
+    free_tail = index + 1;
+    n_flows--;
+}
+
+static uint32_t flow_timeout(uint8_t proto) {
+    switch (proto) {
+        case IPPROTO_TCP:
+            return NAT_TIMEOUT_TCP;
+        case IPPROTO_UDP:
+            return NAT_TIMEOUT_UDP;
+        default:
+            return NAT_TIMEOUT_ICMP;
+    }
+}
+
+/* Allocates a public port and inserts both directions, returns the flow index */
+static int64_t flow_create(const struct nat_tuple *orig, uint64_t now) {
+    int dir;
+    int64_t index;
+
+    ct_write_lock();
+
+    // Another worker may have created it in the meantime
+    index = ct_lookup(orig, &dir);
+    if (index >= 0 || free_head == 0) {
+        ct_write_unlock();
+        return index;
+    }
+
+    struct nat_tuple reply = {
+        .src = orig->dst,
+        .dst = public_addr,
+        .sport = orig->dport,
+        .proto = orig->proto,
+    };
+
+    // Keep the original port if possible, otherwise any port not used
+    // towards the same remote endpoint
+    int found = 0;
+    for (int attempt = 0; attempt < NAT_PORT_ATTEMPTS && !found; attempt++) {
+        if (attempt == 0 && ntohs(orig->sport) >= NAT_PORT_MIN) {
+            reply.dport = orig->sport;
+        } else {
+            reply.dport = htons(NAT_PORT_MIN + port_cursor++ % (65536 - NAT_PORT_MIN));
+        }
+        found = ct_lookup(&reply, &dir) < 0;
+    }
+    if (!found) {
+        ct_write_unlock();
+        return -1;
+    }
+
+    index = free_head - 1;
+    struct nat_flow *f = &flows[index];
+    free_head = f->next;
+    if (free_head == 0) {
+        free_tail = 0;
+    }
+
+    // Free flows have an odd sequence, readers ignore them until published
+    f->orig = *orig;
+    f->reply = reply;
+    f->last_seen = now;
+    f->timeout = flow_timeout(orig->proto);
+    __atomic_store_n(&f->seq, f->seq + 1, __ATOMIC_RELEASE);
+
+    slot_insert(tuple_hash(orig), make_slot(tuple_hash(orig), index, DIR_ORIG));
+    slot_insert(tuple_hash(&reply), make_slot(tuple_hash(&reply), index, DIR_REPLY));
+    wheel_add(index);
+    n_flows++;
+
+    ct_write_unlock();
+    return index;
+}
+
+/*
+ * Extracts the tuple of a packet and the location of its port (or ICMP echo
+ * identifier) and L4 checksum; only first fragments carry the L4 header.
+ */
+static int packet_tuple(struct iphdr *ip_hdr, int dir, struct nat_tuple *t, uint16_t **port,
+                        uint16_t **check) {
+    char *l4 = (char *)ip_hdr + ip_hdr->ihl * 4;
+
+    if ((ntohs(ip_hdr->frag_off) & IP_OFFMASK) != 0) {
+        return -1;
+    }
+
+    memset(t, 0, sizeof(*t));
+    t->src = ip_hdr->saddr;
+    t->dst = ip_hdr->daddr;
+    t->proto = ip_hdr->protocol;
+
+    switch (ip_hdr->protocol) {
+        case IPPROTO_TCP: {
+            struct tcphdr *tcp = (struct tcphdr *)l4;
+            t->sport = tcp->source;
+            t->dport = tcp->dest;
+            *port = dir == DIR_ORIG ? &tcp->source : &tcp->dest;
+            *check = &tcp->check;
+        } break;
+        case IPPROTO_UDP: {
+            struct udphdr *udp = (struct udphdr *)l4;
+            t->sport = udp->source;
+            t->dport = udp->dest;
+            *port = dir == DIR_ORIG ? &udp->source : &udp->dest;
+            *check = &udp->check;
+        } break;
+        case IPPROTO_ICMP: {
+            struct icmphdr *icmp = (struct icmphdr *)l4;
+            if (icmp->type != (dir == DIR_ORIG ? ICMP_ECHO : ICMP_ECHOREPLY)) {
+                return -1;
+            }
+            if (dir == DIR_ORIG) {
+                t->sport = icmp->un.echo.id;
+            } else {
+                t->dport = icmp->un.echo.id;
+            }
+            *port = &icmp->un.echo.id;
+            *check = &icmp->checksum;
+        } break;
+        default:
+            return -1;
+    }
+    return 0;
+}
+
+static uint16_t checksum_update32(uint16_t check, uint32_t old_field, uint32_t new_field) {
+    check = ip_checksum_incremental(check, old_field & 0xffff, new_field & 0xffff);
+    return ip_checksum_incremental(check, old_field >> 16, new_field >> 16);
+}
+
+/* Rewrites an address and port and patches the IP and L4 checksums (RFC 1624) */
+static void rewrite(struct iphdr *ip_hdr, uint32_t *addr, uint32_t new_addr, uint16_t *port,
+                    uint16_t new_port, uint16_t *check) {
+    uint32_t old_addr = *addr;
+    uint16_t old_port = *port;
+
+    ip_hdr->check = checksum_update32(ip_hdr->check, old_addr, new_addr);
+
+    switch (ip_hdr->protocol) {
+        case IPPROTO_UDP:
+            if (*check == 0) {
+                break; // no checksum
+            }
+            // fall through
+        case IPPROTO_TCP:
+            // The pseudo-header includes the addresses
+            *check = checksum_update32(*check, old_addr, new_addr);
+            *check = ip_checksum_incremental(*check, old_port, new_port);
+            if (ip_hdr->protocol == IPPROTO_UDP && *check == 0) {
+                *check = 0xffff;
+            }
+            break;
+        case IPPROTO_ICMP:
+            *check = ip_checksum_incremental(*check, old_port, new_port);
+            break;
+    }
+
+    *addr = new_addr;
+    *port = new_port;
+}
+
+void nat_init(int outside_interface, uint32_t addr, uint32_t max_flows) {
+    DIE(max_flows == 0 || max_flows > (1u << 30), "Invalid NAT table size");
+
+    nat_outside = outside_interface;
+    public_addr = addr;
+
+    // Two keys per flow, load factor at most 1/2
+    uint64_t size = 1;
+    while (size < 4ULL * max_flows) {
+        size <<= 1;
+    }
+    table_mask = size - 1;
+    table = calloc(size, sizeof(uint64_t));
+    flows = calloc(max_flows, sizeof(struct nat_flow));
+    DIE(table == NULL || flows == NULL, "memory");
+
+    for (uint32_t i = 0; i < max_flows; i++) {
+        flows[i].seq = 1;
+        flows[i].next = i + 1 < max_flows ? i + 2 : 0;
+    }
+    free_head = 1;
+    free_tail = max_flows;
+
+    wheel_time = now_ns() / NSEC_PER_SEC;
+
+    struct in_addr in = {addr};
+    printf("NAT: masquerading as %s on interface%d, %u flows\n", inet_ntoa(in),
+           outside_interface, max_flows);
+}
+
+int nat_outbound(struct iphdr *ip_hdr) {
+    struct nat_tuple key;
+    uint16_t *port, *check;
+    int dir;
+
+    if (packet_tuple(ip_hdr, DIR_ORIG, &key, &port, &check) < 0) {
+        return -1;
+    }
+
+    uint64_t now = now_ns() / NSEC_PER_SEC;
+    int64_t index = ct_lookup(&key, &dir);
+    if (index < 0 || dir != DIR_ORIG) {
+        index = flow_create(&key, now);
+        if (index < 0) {
+            return -1; // table full or no free port
+        }
+    }
+
+    struct nat_flow *f = &flows[index];
+    __atomic_store_n(&f->last_seen, now, __ATOMIC_RELAXED);
+    if (key.proto == IPPROTO_TCP) {
+        struct tcphdr *tcp = (struct tcphdr *)((char *)ip_hdr + ip_hdr->ihl * 4);
+        if (tcp->fin || tcp->rst) {
+            f->timeout = NAT_TIMEOUT_TCP_CLOSING;
+        }
+    }
+
+    rewrite(ip_hdr, &ip_hdr->saddr, public_addr, port, f->reply.dport, check);
+    return 0;
+}
+
+int nat_inbound(struct iphdr *ip_hdr) {
+    struct nat_tuple key;
+    uint16_t *port, *check;
+    int dir;
+
+    if (ip_hdr->daddr != public_addr) {
+        return 0;
+    }
+    if (packet_tuple(ip_hdr, DIR_REPLY, &key, &port, &check) < 0) {
+        return -1;
+    }
+
+    int64_t index = ct_lookup(&key, &dir);
+    if (index < 0 || dir != DIR_REPLY) {
+        return -1;
+    }
+
+    struct nat_flow *f = &flows[index];
+    __atomic_store_n(&f->last_seen, now_ns() / NSEC_PER_SEC, __ATOMIC_RELAXED);
+    if (key.proto == IPPROTO_TCP) {
+        struct tcphdr *tcp = (struct tcphdr *)((char *)ip_hdr + ip_hdr->ihl * 4);
+        if (tcp->fin || tcp->rst) {
+            f->timeout = NAT_TIMEOUT_TCP_CLOSING;
+        }
+    }
+
+    rewrite(ip_hdr, &ip_hdr->daddr, f->orig.src, port, f->orig.sport, check);
+    return 1;
+}
+
+void nat_tick(uint64_t now) {
+    uint64_t now_s = now / NSEC_PER_SEC;
+
+    if (nat_outside < 0 || now_s <= wheel_time) {
+        return;
+    }
+
+    ct_write_lock();
+
+    // After a long pause one lap of the wheel visits every flow
+    if (now_s - wheel_time > NAT_WHEEL_SIZE) {
+        wheel_time = now_s - NAT_WHEEL_SIZE;
+    }
+
+    while (wheel_time < now_s) {
+        wheel_time++;
+        uint64_t bucket = wheel_time % NAT_WHEEL_SIZE;
+        uint32_t cur = wheel[bucket];
+        wheel[bucket] = 0;
+
+        while (cur != 0) {
+            uint32_t index = cur - 1;
+            struct nat_flow *f = &flows[index];
+            cur = f->next;
+
+            // Refreshed flows are rescheduled lazily
+            if (__atomic_load_n(&f->last_seen, __ATOMIC_RELAXED) + f->timeout <= wheel_time) {
+                flow_free(index);
+            } else {
+                wheel_add(index);
+            }
+        }
+    }
+
+    ct_write_unlock();
+}
+
+uint32_t nat_flow_count(void) {
+    return n_flows;
+}
@@ -0,0 +1,154 @@
+#include "neigh.h"
+#include "timeutil.h"
+
+static struct arp_entry table[NEIGH_TABLE_SIZE];
+static uint64_t timeout = NEIGH_DEFAULT_TIMEOUT * NSEC_PER_SEC;
+static uint64_t next_tick;
+
+void neigh_init(uint32_t timeout_s) {
+    DIE(timeout_s <= NEIGH_REFRESH, "Invalid ARP timeout");
+    timeout = timeout_s * NSEC_PER_SEC;
+}
+
+static uint32_t neigh_hash(uint32_t ip) {
+    return (ip * 0x9e3779b1u) >> 22; // top log2(NEIGH_TABLE_SIZE) bits
+}
+
+/* Slot holding ip, or the free slot where it belongs (NULL if full) */
+static struct arp_entry *neigh_slot(uint32_t ip) {
+    uint32_t h = neigh_hash(ip);
+
+    for (int i = 0; i < NEIGH_TABLE_SIZE; i++) {
+        struct arp_entry *e = &table[(h + i) & (NEIGH_TABLE_SIZE - 1)];
+        if (e->state == NEIGH_FREE || e->ip == ip) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+void parse_arp_table(char *filename) {
+    FILE *f = fopen(filename, "r");
+    DIE(f == NULL, "Failed to open ARP table file");
+
+    char line[200];
+    while (fgets(line, sizeof(line), f)) {
+        char ip_str[50];
+        uint8_t mac[ETH_ALEN];
+
+        if (sscanf(line, "%49s %hhx:%hhx:%hhx:%hhx:%hhx:%hhx", ip_str,
+                   &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]) != 7) {
+            continue;
+        }
+
+        uint32_t ip = inet_addr(ip_str);
+        struct arp_entry *e = neigh_slot(ip);
+        DIE(e == NULL, "ARP table full");
+        e->ip = ip;
+        memcpy(e->mac, mac, ETH_ALEN);
+        e->state = NEIGH_STATIC;
+        e->interface = -1;
+    }
+
+    fclose(f);
+}
+
+struct arp_entry *neigh_lookup(uint32_t ip, uint64_t now) {
+    struct arp_entry *e = neigh_slot(ip);
+
+    if (e == NULL || e->state == NEIGH_FREE || e->state == NEIGH_INCOMPLETE) {
+        return NULL;
+    }
+    if (e->state == NEIGH_REACHABLE) {
+        if (now >= e->expires) {
+            return NULL;
+        }
+        e->flags |= NEIGH_F_USED;
+    }
+    return e;
+}
+
+void neigh_update(uint32_t ip, uint8_t *mac, int interface, uint64_t now) {
+    struct arp_entry *e = neigh_slot(ip);
+
+    if (e == NULL) {
+        return; // full, the next packet will ask again
+    }
+    if (e->state == NEIGH_STATIC) {
+        return;
+    }
+
+    e->ip = ip;
+    memcpy(e->mac, mac, ETH_ALEN);
+    e->state = NEIGH_REACHABLE;
+    e->flags &= ~NEIGH_F_USED;
+    e->interface = interface;
+    e->expires = now + timeout;
+}
+
+void neigh_probe(uint32_t ip, int interface) {
+    struct ether_header eth_hdr;
+
+    eth_hdr.ether_type = htons(ETHERTYPE_ARP);
+    get_interface_mac(interface, eth_hdr.ether_shost);
+    memset(eth_hdr.ether_dhost, 0xff, ETH_ALEN); // broadcast
+
+    send_arp(ip, inet_addr(get_interface_ip(interface)), &eth_hdr, interface, ARPOP_REQUEST);
+}
+
+static void warmup_next_hop(struct trie_node *node) {
+    if (node == NULL) {
+        return;
+    }
+
+    if (node->interface != -1 && node->next_hop != 0) {
+        struct arp_entry *e = neigh_slot(node->next_hop);
+        DIE(e == NULL, "ARP table full");
+        if (e->state == NEIGH_FREE) {
+            e->ip = node->next_hop;
+            e->state = NEIGH_INCOMPLETE;
+        }
+        if (e->state != NEIGH_STATIC && !(e->flags & NEIGH_F_NEXTHOP)) {
+            e->flags |= NEIGH_F_NEXTHOP;
+            e->interface = node->interface;
+            e->probed = now_ns();
+            neigh_probe(e->ip, e->interface);
+        }
+    }
+
+    warmup_next_hop(node->l);
+    warmup_next_hop(node->r);
+}
+
+void neigh_warmup(struct trie_node *root) {
+    warmup_next_hop(root);
+}
+
+void neigh_tick(uint64_t now) {
+    if (now < next_tick) {
+        return;
+    }
+    next_tick = now + NEIGH_PROBE_INTERVAL * NSEC_PER_SEC;
+
+    for (int i = 0; i < NEIGH_TABLE_SIZE; i++) {
+        struct arp_entry *e = &table[i];
+
+        if (e->state == NEIGH_FREE || e->state == NEIGH_STATIC || e->interface < 0) {
+            continue;
+        }
+        if (now - e->probed < NEIGH_PROBE_INTERVAL * NSEC_PER_SEC) {
+            continue;
+        }
+
+        // Next hops are retried until they answer, other entries are only
+        // refreshed while still valid and in use
+        int expiring = now + NEIGH_REFRESH * NSEC_PER_SEC >= e->expires;
+        int wanted = (e->flags & NEIGH_F_NEXTHOP) ||
+                     (e->state == NEIGH_REACHABLE && (e->flags & NEIGH_F_USED) && now < e->expires);
+        int due = e->state == NEIGH_INCOMPLETE || expiring;
+        if (wanted && due) {
+            e->probed = now;
+            neigh_probe(e->ip, e->interface);
+        }
+    }
+}
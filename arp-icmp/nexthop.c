@@ -0,0 +1,144 @@
+#include "nexthop.h"
+#include "neigh.h"
+#include "timeutil.h"
+
+struct nh_member nh_members[NH_MAX_MEMBERS];
+static int n_members;
+
+static struct nh_group **groups;
+static int n_groups;
+
+static uint64_t interval = NH_DEFAULT_INTERVAL * NSEC_PER_MSEC;
+static uint32_t multiplier = NH_DEFAULT_MULTIPLIER;
+static uint64_t next_probe;
+
+void nh_init(uint32_t interval_ms, uint32_t mult) {
+    DIE(interval_ms == 0 || mult == 0, "Invalid next-hop probe timing");
+    interval = interval_ms * NSEC_PER_MSEC;
+    multiplier = mult;
+}
+
+static int member_get(uint32_t ip, int interface) {
+    for (int i = 0; i < n_members; i++) {
+        if (nh_members[i].ip == ip && nh_members[i].interface == interface) {
+            return i;
+        }
+    }
+
+    DIE(n_members == NH_MAX_MEMBERS, "Too many backup next hops");
+    struct nh_member *m = &nh_members[n_members];
+    m->ip = ip;
+    m->interface = interface;
+    m->alive = 1; // until it misses its first probes
+    m->last_reply = now_ns();
+    return n_members++;
+}
+
+struct nh_group *nh_group_get(uint32_t primary, int primary_interface,
+                              uint32_t backup, int backup_interface) {
+    int p = member_get(primary, primary_interface);
+    int b = member_get(backup, backup_interface);
+
+    for (int i = 0; i < n_groups; i++) {
+        if (groups[i]->member[0] == p && groups[i]->member[1] == b) {
+            return groups[i];
+        }
+    }
+
+    groups = realloc(groups, (n_groups + 1) * sizeof(struct nh_group *));
+    DIE(groups == NULL, "memory");
+    struct nh_group *g = calloc(1, sizeof(struct nh_group));
+    DIE(g == NULL, "memory");
+    g->member[0] = p;
+    g->member[1] = b;
+    groups[n_groups++] = g;
+    return g;
+}
+
+int nh_enabled(void) {
+    return n_groups > 0;
+}
+
+/* Prefers the primary while it is alive; the backup only if it is alive */
+static void reselect(uint64_t now) {
+    for (int i = 0; i < n_groups; i++) {
+        struct nh_group *g = groups[i];
+        int active = !nh_members[g->member[0]].alive && nh_members[g->member[1]].alive;
+
+        if (active != g->active) {
+            __atomic_store_n(&g->active, active, __ATOMIC_RELEASE);
+            struct nh_member *m = &nh_members[g->member[active]];
+            printf("[%llu.%03llu] Next-hop group %d now via %s interface%d\n",
+                   (unsigned long long)(now / NSEC_PER_SEC),
+                   (unsigned long long)(now % NSEC_PER_SEC / NSEC_PER_MSEC),
+                   i, inet_ntoa(*(struct in_addr *)&m->ip), m->interface);
+        }
+    }
+}
+
+int nh_input(struct iphdr *ip_hdr, struct icmphdr *icmp_hdr, uint64_t now) {
+    if (icmp_hdr->type != ICMP_ECHOREPLY || ntohs(icmp_hdr->un.echo.id) != NH_PROBE_ID) {
+        return 0;
+    }
+
+    for (int i = 0; i < n_members; i++) {
+        struct nh_member *m = &nh_members[i];
+        if (m->ip != ip_hdr->saddr) {
+            continue;
+        }
+        m->last_reply = now;
+        if (!m->alive) {
+            m->alive = 1;
+            printf("Next hop %s is up\n", inet_ntoa(*(struct in_addr *)&m->ip));
+            reselect(now);
+        }
+    }
+    return 1;
+}
+
+void nh_tick(uint64_t now) {
+    if (n_groups == 0 || now < next_probe) {
+        return;
+    }
+    next_probe = now + interval;
+
+    int changed = 0;
+    for (int i = 0; i < n_members; i++) {
+        struct nh_member *m = &nh_members[i];
+
+        if (m->alive && now - m->last_reply > multiplier * interval) {
+            m->alive = 0;
+            changed = 1;
+            printf("Next hop %s is down\n", inet_ntoa(*(struct in_addr *)&m->ip));
+        }
+
+        // Probes need the neighbour's MAC; resolve it first
+        struct arp_entry *e = neigh_lookup(m->ip, now);
+        if (e == NULL) {
+            neigh_probe(m->ip, m->interface);
+            continue;
+        }
+
+        uint32_t addr = inet_addr(get_interface_ip(m->interface));
+        uint8_t mac[ETH_ALEN];
+        get_interface_mac(m->interface, mac);
+        send_icmp(m->ip, addr, mac, e->mac, ICMP_ECHO, 0, m->interface,
+                  htons(NH_PROBE_ID), htons(m->seq++));
+    }
+
+    if (changed) {
+        reselect(now);
+    }
+}
+
+void nh_dump(FILE *f) {
+    fprintf(f, "Next hops\n");
+    for (int i = 0; i < n_members; i++) {
+        fprintf(f, "  %s interface%d %s\n", inet_ntoa(*(struct in_addr *)&nh_members[i].ip),
+                nh_members[i].interface, nh_members[i].alive ? "up" : "down");
+    }
+    for (int i = 0; i < n_groups; i++) {
+        fprintf(f, "  group %d: active %s\n", i,
+                inet_ntoa(*(struct in_addr *)&nh_members[groups[i]->member[groups[i]->active]].ip));
+    }
+}
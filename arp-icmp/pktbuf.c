@@ -0,0 +1,72 @@
+#include "pktbuf.h"
+#include <stddef.h>
+
+static const int class_size[PKTBUF_CLASSES] = {128, 512, 2048, MAX_LEN};
+
+/* Precedes every buffer; links it into the free list while unused */
+struct pktbuf {
+    struct pktbuf *next;
+    int cls;
+    int refs;
+    char data[] __attribute__((aligned(16)));
+};
+
+static struct pktbuf *free_list[PKTBUF_CLASSES];
+static int free_count[PKTBUF_CLASSES];
+
+static int size_class(int len) {
+    for (int c = 0; c < PKTBUF_CLASSES; c++) {
+        if (len <= class_size[c]) {
+            return c;
+        }
+    }
+    DIE(1, "Packet larger than MAX_LEN");
+    return -1;
+}
+
+char *pktbuf_alloc(int len) {
+    int c = size_class(len);
+    struct pktbuf *b = free_list[c];
+
+    if (b != NULL) {
+        free_list[c] = b->next;
+        free_count[c]--;
+    } else {
+        b = malloc(sizeof(struct pktbuf) + class_size[c]);
+        DIE(b == NULL, "memory");
+        b->cls = c;
+    }
+    b->refs = 1;
+    return b->data;
+}
+
+char *pktbuf_ref(char *buf) {
+    struct pktbuf *b = (struct pktbuf *)(buf - offsetof(struct pktbuf, data));
+    b->refs++;
+    return buf;
+}
+
+void pktbuf_free(char *buf) {
+    if (buf == NULL) {
+        return;
+    }
+
+    struct pktbuf *b = (struct pktbuf *)(buf - offsetof(struct pktbuf, data));
+    if (--b->refs > 0) {
+        return;
+    }
+    if (free_count[b->cls] >= PKTBUF_CACHE) {
+        free(b);
+        return;
+    }
+    b->next = free_list[b->cls];
+    free_list[b->cls] = b;
+    free_count[b->cls]++;
+}
+
+void pktbuf_clone(packet *dst, const packet *src) {
+    dst->len = src->len;
+    dst->interface = src->interface;
+    dst->payload = pktbuf_alloc(src->len);
+    memcpy(dst->payload, src->payload, src->len);
+}
@@ -0,0 +1,230 @@
+#include "policy.h"
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct policy_node *node_alloc(void) {
+    struct policy_node *n = malloc(sizeof(struct policy_node));
+    if (n == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+        n->rule[i] = -1;
+    }
+    n->l = n->r = NULL;
+    return n;
+}
+
+static void node_free(struct policy_node *n) {
+    if (n != NULL) {
+        node_free(n->l);
+        node_free(n->r);
+        free(n);
+    }
+}
+
+static int parse_prefix(const char *str, uint32_t *addr, uint8_t *len) {
+    char buf[32];
+    int plen = 32;
+
+    if (strcmp(str, "any") == 0) {
+        *addr = 0;
+        *len = 0;
+        return 0;
+    }
+
+    snprintf(buf, sizeof(buf), "%s", str);
+    char *slash = strchr(buf, '/');
+    if (slash != NULL) {
+        *slash = '\0';
+        plen = atoi(slash + 1);
+    }
+
+    struct in_addr in;
+    if (inet_aton(buf, &in) == 0 || plen < 0 || plen > 32) {
+        return -1;
+    }
+
+    *addr = in.s_addr & (plen == 0 ? 0 : htonl(~0u << (32 - plen)));
+    *len = plen;
+    return 0;
+}
+
+/* Index of the table read from file, loaded the first time it is named */
+static int find_table(struct policy *p, const char *file,
+                      struct trie_node *(*load_table)(char *filename)) {
+    for (int i = 0; i < p->n_tables; i++) {
+        if (strcmp(p->table_names[i], file) == 0) {
+            return i;
+        }
+    }
+    if (p->n_tables == POLICY_MAX_TABLES) {
+        return -2;
+    }
+
+    p->table_names[p->n_tables] = strdup(file);
+    if (p->table_names[p->n_tables] == NULL) {
+        return -2;
+    }
+    p->tables[p->n_tables] = load_table(p->table_names[p->n_tables]);
+    return p->n_tables++;
+}
+
+static int parse_rule(struct policy *p, char *line, struct policy_rule *rule,
+                      struct trie_node *(*load_table)(char *filename)) {
+    char src[32], iif[16], table[200];
+
+    memset(rule, 0, sizeof(*rule));
+    if (sscanf(line, "%31s %15s %199s", src, iif, table) != 3) {
+        return -1;
+    }
+    if (parse_prefix(src, &rule->src, &rule->src_len) < 0) {
+        return -1;
+    }
+
+    if (strcmp(iif, "any") == 0) {
+        rule->iif = -1;
+    } else {
+        char *end;
+        rule->iif = strtol(iif, &end, 10);
+        if (*end != '\0' || rule->iif < 0 || rule->iif >= ROUTER_NUM_INTERFACES) {
+            return -1;
+        }
+    }
+
+    rule->table = strcmp(table, "main") == 0 ? -1 : find_table(p, table, load_table);
+    return rule->table == -2 ? -1 : 0;
+}
+
+/* Records rule r at the node of its source prefix for the interfaces it covers */
+static int compile_rule(struct policy *p, int r) {
+    struct policy_rule *rule = &p->rules[r];
+    struct policy_node **t = &p->root;
+    uint32_t src = ntohl(rule->src);
+
+    for (int depth = 0;; depth++) {
+        if (*t == NULL && (*t = node_alloc()) == NULL) {
+            return -1;
+        }
+        if (depth == rule->src_len) {
+            break;
+        }
+        t = ((src >> (31 - depth)) & 1) ? &(*t)->r : &(*t)->l;
+    }
+
+    for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+        // An earlier rule with the same prefix and interface shadows this one
+        if ((rule->iif == -1 || rule->iif == i) && (*t)->rule[i] == -1) {
+            (*t)->rule[i] = r;
+        }
+    }
+    return 0;
+}
+
+static void policy_free(struct policy *p) {
+    for (int i = 0; i < p->n_tables; i++) {
+        free(p->table_names[i]);
+    }
+    node_free(p->root);
+    free(p->rules);
+    free(p);
+}
+
+struct policy *policy_load(const char *filename, struct trie_node *(*load_table)(char *filename)) {
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        perror(filename);
+        return NULL;
+    }
+
+    struct policy *p = calloc(1, sizeof(struct policy));
+    if (p != NULL) {
+        p->rules = calloc(POLICY_MAX_RULES, sizeof(struct policy_rule));
+        if (p->rules == NULL) {
+            free(p);
+            p = NULL;
+        }
+    }
+
+    int lineno = 0;
+    char line[256];
+
+    while (p != NULL && fgets(line, sizeof(line), f)) {
+        lineno++;
+
+        char *comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+        if (strspn(line, " \t\r\n") == strlen(line)) {
+            continue;
+        }
+
+        if (p->n_rules == POLICY_MAX_RULES ||
+            parse_rule(p, line, &p->rules[p->n_rules], load_table) < 0 ||
+            compile_rule(p, p->n_rules) < 0) {
+            fprintf(stderr, "%s:%d: invalid policy rule\n", filename, lineno);
+            policy_free(p);
+            p = NULL;
+            break;
+        }
+        p->n_rules++;
+    }
+    fclose(f);
+
+    if (p != NULL) {
+        printf("Policy: %d rules, %d tables\n", p->n_rules, p->n_tables);
+    }
+    return p;
+}
+
+int policy_route(struct policy *p, struct trie_node *main, uint32_t src, uint32_t dst, int iif,
+                 uint32_t *next_hop) {
+    struct policy_node *t = p->root;
+    int best = -1;
+
+    src = ntohl(src);
+
+    // First rule on the path of the source address; rule indexes only grow
+    // with the file order, so the smallest one wins
+    for (int depth = 0; t != NULL; depth++) {
+        int r = t->rule[iif];
+        if (r != -1 && (best == -1 || r < best)) {
+            best = r;
+        }
+        if (depth == 32) {
+            break;
+        }
+        t = ((src >> (31 - depth)) & 1) ? t->r : t->l;
+    }
+
+    if (best != -1) {
+        struct policy_rule *rule = &p->rules[best];
+        rule->hits++;
+        if (rule->table != -1) {
+            int interface = search_route(p->tables[rule->table], dst, next_hop);
+            if (interface != -1) {
+                return interface;
+            }
+        }
+    }
+    return search_route(main, dst, next_hop);
+}
+
+void policy_dump(struct policy *p, FILE *f) {
+    fprintf(f, "Policy hits (%d rules)\n", p->n_rules);
+
+    for (int r = 0; r < p->n_rules; r++) {
+        struct policy_rule *rule = &p->rules[r];
+        char src[INET_ADDRSTRLEN], iif[16];
+        inet_ntop(AF_INET, &rule->src, src, sizeof(src));
+        if (rule->iif == -1) {
+            snprintf(iif, sizeof(iif), "any");
+        } else {
+            snprintf(iif, sizeof(iif), "%d", rule->iif);
+        }
+
+        fprintf(f, "%4d from %s/%d iif %s table %s: %lu\n", r, src, rule->src_len, iif,
+                rule->table == -1 ? "main" : p->table_names[rule->table], rule->hits);
+    }
+}
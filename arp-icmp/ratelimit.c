@@ -0,0 +1,221 @@
+#include "ratelimit.h"
+#include <netinet/udp.h>
+#include "rip.h"
+#include "stats.h"
+#include "timeutil.h"
+
+const char *icmp_class_names[ICMP_CLASS_MAX] = {
+    [ICMP_CLASS_TIME_EXCEEDED] = "time_exceeded",
+    [ICMP_CLASS_DEST_UNREACH] = "dest_unreach",
+    [ICMP_CLASS_ECHO_REPLY] = "echo_reply",
+};
+
+const char *copp_class_names[COPP_CLASS_MAX] = {
+    [COPP_ICMP] = "icmp",
+    [COPP_ARP] = "arp",
+    [COPP_RIP] = "rip",
+    [COPP_OTHER] = "other",
+};
+
+/* Defaults: rate/burst of the class, then of each source bucket */
+static const uint64_t copp_defaults[COPP_CLASS_MAX][4] = {
+    [COPP_ICMP] = {1000, 100, 100, 20},
+    [COPP_ARP] = {1000, 100, 50, 20},
+    [COPP_RIP] = {2000, 1000, 1000, 500}, // a full table arrives as one burst
+    [COPP_OTHER] = {100, 20, 20, 10},
+};
+
+static struct token_bucket icmp_global[ICMP_CLASS_MAX];
+static struct token_bucket icmp_if[ROUTER_NUM_INTERFACES][ICMP_CLASS_MAX];
+static struct token_bucket copp_class[COPP_CLASS_MAX];
+static struct token_bucket copp_src[COPP_CLASS_MAX][COPP_SRC_BUCKETS];
+
+void tb_init(struct token_bucket *tb, uint64_t rate, uint64_t burst) {
+    tb->rate = rate;
+    tb->burst = burst;
+    tb->tokens = burst * TB_SCALE;
+    tb->last = now_ns();
+}
+
+void tb_refill(struct token_bucket *tb, uint64_t now) {
+    uint64_t elapsed = now - tb->last;
+    uint64_t max = tb->burst * TB_SCALE;
+
+    tb->last = now;
+    if (tb->rate == 0) {
+        return;
+    }
+
+    // A long idle period fills the bucket (also avoids overflowing below)
+    if (elapsed >= NSEC_PER_SEC * (tb->burst / tb->rate + 1)) {
+        tb->tokens = max;
+        return;
+    }
+
+    tb->tokens += tb->rate * elapsed;
+    if (tb->tokens > max) {
+        tb->tokens = max;
+    }
+}
+
+int tb_consume(struct token_bucket *tb, uint64_t now) {
+    if (tb->rate == 0) {
+        return 1;
+    }
+
+    tb_refill(tb, now);
+    if (tb->tokens < TB_SCALE) {
+        return 0;
+    }
+
+    tb->tokens -= TB_SCALE;
+    return 1;
+}
+
+void icmp_limit_init(uint64_t rate, uint64_t burst, uint64_t if_rate, uint64_t if_burst) {
+    for (int c = 0; c < ICMP_CLASS_MAX; c++) {
+        tb_init(&icmp_global[c], rate, burst);
+        for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+            tb_init(&icmp_if[i][c], if_rate, if_burst);
+        }
+    }
+}
+
+int icmp_limit_allow(enum icmp_class cls, int interface) {
+    struct token_bucket *g = &icmp_global[cls];
+    struct token_bucket *l = &icmp_if[interface][cls];
+    uint64_t now = now_ns();
+
+    tb_refill(g, now);
+    tb_refill(l, now);
+
+    if ((g->rate != 0 && g->tokens < TB_SCALE) || (l->rate != 0 && l->tokens < TB_SCALE)) {
+        stats->icmp_suppressed[interface][cls]++;
+        return 0;
+    }
+
+    if (g->rate != 0) {
+        g->tokens -= TB_SCALE;
+    }
+    if (l->rate != 0) {
+        l->tokens -= TB_SCALE;
+    }
+    return 1;
+}
+
+uint64_t icmp_limit_suppressed(enum icmp_class cls, int interface) {
+    return stats->icmp_suppressed[interface][cls];
+}
+
+void copp_set(enum copp_class cls, uint64_t rate, uint64_t burst, uint64_t src_rate,
+              uint64_t src_burst) {
+    tb_init(&copp_class[cls], rate, burst);
+    for (int b = 0; b < COPP_SRC_BUCKETS; b++) {
+        tb_init(&copp_src[cls][b], src_rate, src_burst);
+    }
+}
+
+void copp_init(void) {
+    for (int c = 0; c < COPP_CLASS_MAX; c++) {
+        copp_set(c, copp_defaults[c][0], copp_defaults[c][1], copp_defaults[c][2],
+                 copp_defaults[c][3]);
+    }
+}
+
+int copp_parse(char *spec, int per_source) {
+    for (char *tok = strtok(spec, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        char name[16];
+        uint64_t rate, burst;
+        int n = sscanf(tok, "%15[a-z]=%lu/%lu", name, &rate, &burst);
+        if (n < 2) {
+            return -1;
+        }
+        if (n == 2) {
+            burst = rate / 10 > 1 ? rate / 10 : 1;
+        }
+
+        int found = 0;
+        for (int c = 0; c < COPP_CLASS_MAX; c++) {
+            if (strcmp(name, "all") != 0 && strcmp(name, copp_class_names[c]) != 0) {
+                continue;
+            }
+            struct token_bucket *cls = &copp_class[c], *src = &copp_src[c][0];
+            if (per_source) {
+                copp_set(c, cls->rate, cls->burst, rate, burst);
+            } else {
+                copp_set(c, rate, burst, src->rate, src->burst);
+            }
+            found = 1;
+        }
+        if (!found) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Class of a frame addressed to the router and its sender, -1 for transit */
+static int copp_classify(const char *frame, int len, uint32_t router_addr, uint32_t *src) {
+    const struct ether_header *eth_hdr = (const struct ether_header *)frame;
+
+    if (ntohs(eth_hdr->ether_type) == ETHERTYPE_ARP) {
+        const struct arp_header *arp_hdr = (const struct arp_header *)(eth_hdr + 1);
+        if (len < (int)(sizeof(*eth_hdr) + sizeof(*arp_hdr)) || arp_hdr->tpa != router_addr) {
+            return -1;
+        }
+        *src = arp_hdr->spa;
+        return COPP_ARP;
+    }
+
+    if (ntohs(eth_hdr->ether_type) != ETHERTYPE_IP ||
+        len < (int)(sizeof(*eth_hdr) + sizeof(struct iphdr))) {
+        return -1;
+    }
+    const struct iphdr *ip_hdr = (const struct iphdr *)(eth_hdr + 1);
+    if (ip_hdr->daddr != router_addr && ip_hdr->daddr != htonl(RIP_GROUP)) {
+        return -1;
+    }
+
+    *src = ip_hdr->saddr;
+    if (ip_hdr->protocol == IPPROTO_ICMP) {
+        return COPP_ICMP;
+    }
+    if (ip_hdr->protocol == IPPROTO_UDP &&
+        len >= (int)(sizeof(*eth_hdr) + ip_hdr->ihl * 4 + sizeof(struct udphdr))) {
+        const struct udphdr *udp_hdr = (const struct udphdr *)((const char *)ip_hdr +
+                                                               ip_hdr->ihl * 4);
+        if (ntohs(udp_hdr->dest) == RIP_PORT) {
+            return COPP_RIP;
+        }
+    }
+    return COPP_OTHER;
+}
+
+int copp_allow(const char *frame, int len, uint32_t router_addr) {
+    uint32_t src;
+    int cls = copp_classify(frame, len, router_addr, &src);
+    if (cls < 0) {
+        return 1;
+    }
+
+    uint32_t h = src * 0x9e3779b1u;
+    struct token_bucket *c = &copp_class[cls];
+    struct token_bucket *s = &copp_src[cls][(h ^ (h >> 16)) & (COPP_SRC_BUCKETS - 1)];
+    uint64_t now = now_ns();
+
+    // As for ICMP, both buckets give a token or neither does
+    tb_refill(c, now);
+    tb_refill(s, now);
+    if ((c->rate != 0 && c->tokens < TB_SCALE) || (s->rate != 0 && s->tokens < TB_SCALE)) {
+        stats->copp_dropped[cls]++;
+        return 0;
+    }
+    if (c->rate != 0) {
+        c->tokens -= TB_SCALE;
+    }
+    if (s->rate != 0) {
+        s->tokens -= TB_SCALE;
+    }
+    stats->copp_passed[cls]++;
+    return 1;
+}
@@ -0,0 +1,378 @@
+#include "rip.h"
+#include <netinet/udp.h>
+#include "egress.h"
+#include "timeutil.h"
+
+int rip_enabled;
+
+static struct rip_route *buckets[RIP_BUCKETS];
+static struct rip_route *routes; /* every route, in insertion order */
+static struct trie_node *fib;
+
+static uint64_t interval;
+static uint64_t route_timeout;
+static uint64_t garbage_time;
+static uint64_t start;
+static uint64_t next_update;
+static uint64_t next_trigger;
+static uint64_t next_sweep;
+static int trigger_pending;
+static int link_up[ROUTER_NUM_INTERFACES];
+
+static uint32_t rip_hash(uint32_t prefix, uint32_t mask) {
+    return ((prefix ^ (mask * 0x9e3779b1u)) * 0x85ebca6bu) >> 16;
+}
+
+static struct rip_route *rip_lookup(uint32_t prefix, uint32_t mask) {
+    struct rip_route *r = buckets[rip_hash(prefix, mask)];
+
+    while (r != NULL && (r->prefix != prefix || r->mask != mask)) {
+        r = r->hash_next;
+    }
+    return r;
+}
+
+static struct rip_route *rip_add(uint32_t prefix, uint32_t mask) {
+    struct rip_route *r = calloc(1, sizeof(struct rip_route));
+    DIE(r == NULL, "memory");
+
+    uint32_t h = rip_hash(prefix, mask);
+    r->prefix = prefix;
+    r->mask = mask;
+    r->hash_next = buckets[h];
+    buckets[h] = r;
+    r->list_next = routes;
+    routes = r;
+    return r;
+}
+
+static void rip_unlink(struct rip_route *r) {
+    struct rip_route **p = &buckets[rip_hash(r->prefix, r->mask)];
+
+    while (*p != r) {
+        p = &(*p)->hash_next;
+    }
+    *p = r->hash_next;
+}
+
+static void rip_log(const char *what, struct rip_route *r, uint64_t now) {
+    char prefix[INET_ADDRSTRLEN], next_hop[INET_ADDRSTRLEN];
+
+    inet_ntop(AF_INET, &r->prefix, prefix, sizeof(prefix));
+    inet_ntop(AF_INET, &r->next_hop, next_hop, sizeof(next_hop));
+    // Timestamps are relative to rip_init so convergence can be read off the log
+    printf("[%llu.%03llu] RIP %s %s/%d via %s interface%d metric %d\n",
+           (unsigned long long)((now - start) / NSEC_PER_SEC),
+           (unsigned long long)((now - start) % NSEC_PER_SEC / NSEC_PER_MSEC),
+           what, prefix, get_bit_count_from_mask(r->mask), next_hop, r->interface, r->metric);
+}
+
+static void rip_changed(struct rip_route *r) {
+    r->changed = 1;
+    trigger_pending = 1;
+}
+
+/* Marks a route unreachable; it is advertised as such until garbage collected */
+static void rip_withdraw(struct rip_route *r, const char *why, uint64_t now) {
+    r->metric = RIP_INFINITY;
+    r->garbage = now + garbage_time;
+    delete_route(fib, r->prefix, r->mask);
+    rip_changed(r);
+    rip_log(why, r, now);
+}
+
+static void send_message(int interface, uint8_t command, char *buf, int entries) {
+    static const uint8_t group_mac[ETH_ALEN] = {0x01, 0x00, 0x5e, 0x00, 0x00, 0x09};
+    struct ether_header *eth_hdr = (struct ether_header *)buf;
+    struct iphdr *ip_hdr = (struct iphdr *)(eth_hdr + 1);
+    struct udphdr *udp_hdr = (struct udphdr *)(ip_hdr + 1);
+    struct rip_header *rip_hdr = (struct rip_header *)(udp_hdr + 1);
+    int rip_len = sizeof(struct rip_header) + entries * sizeof(struct rip_entry);
+
+    memcpy(eth_hdr->ether_dhost, group_mac, ETH_ALEN);
+    get_interface_mac(interface, eth_hdr->ether_shost);
+    eth_hdr->ether_type = htons(ETHERTYPE_IP);
+
+    memset(ip_hdr, 0, sizeof(struct iphdr));
+    ip_hdr->version = 4;
+    ip_hdr->ihl = 5;
+    ip_hdr->tos = 0xc0; // CS6, network control
+    ip_hdr->tot_len = htons(sizeof(struct iphdr) + sizeof(struct udphdr) + rip_len);
+    ip_hdr->ttl = 1;
+    ip_hdr->protocol = IPPROTO_UDP;
+    ip_hdr->saddr = inet_addr(get_interface_ip(interface));
+    ip_hdr->daddr = htonl(RIP_GROUP);
+    ip_hdr->check = ip_checksum(ip_hdr, sizeof(struct iphdr));
+
+    udp_hdr->source = htons(RIP_PORT);
+    udp_hdr->dest = htons(RIP_PORT);
+    udp_hdr->len = htons(sizeof(struct udphdr) + rip_len);
+    udp_hdr->check = 0; // optional over IPv4
+
+    rip_hdr->command = command;
+    rip_hdr->version = RIP_VERSION;
+    rip_hdr->zero = 0;
+
+    packet m = {
+        .payload = buf,
+        .len = sizeof(struct ether_header) + ntohs(ip_hdr->tot_len),
+        .interface = interface,
+    };
+    egress_send(interface, &m);
+}
+
+#define RIP_MSG_LEN (sizeof(struct ether_header) + sizeof(struct iphdr) + sizeof(struct udphdr) + \
+                     sizeof(struct rip_header) + RIP_MAX_ENTRIES * sizeof(struct rip_entry))
+#define RIP_ENTRIES(buf) ((struct rip_entry *)((buf) + RIP_MSG_LEN - RIP_MAX_ENTRIES * sizeof(struct rip_entry)))
+
+static void send_request(int interface) {
+    char buf[RIP_MSG_LEN];
+    struct rip_entry *entry = RIP_ENTRIES(buf);
+
+    // A single entry of family 0 and metric 16 asks for the whole table
+    memset(entry, 0, sizeof(struct rip_entry));
+    entry->metric = htonl(RIP_INFINITY);
+    send_message(interface, RIP_REQUEST, buf, 1);
+}
+
+static void send_update(int interface, int triggered) {
+    char buf[RIP_MSG_LEN];
+    struct rip_entry *entries = RIP_ENTRIES(buf);
+    int n = 0;
+
+    for (struct rip_route *r = routes; r != NULL; r = r->list_next) {
+        if (triggered && !r->changed) {
+            continue;
+        }
+        if (r->interface == interface) {
+            continue; // split horizon
+        }
+
+        entries[n].family = htons(AF_INET);
+        entries[n].tag = 0;
+        entries[n].addr = r->prefix;
+        entries[n].mask = r->mask;
+        entries[n].next_hop = 0;
+        entries[n].metric = htonl(r->metric);
+        if (++n == RIP_MAX_ENTRIES) {
+            send_message(interface, RIP_RESPONSE, buf, n);
+            n = 0;
+        }
+    }
+
+    if (n > 0) {
+        send_message(interface, RIP_RESPONSE, buf, n);
+    }
+}
+
+static void send_updates(int triggered) {
+    for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+        if (link_up[i]) {
+            send_update(i, triggered);
+        }
+    }
+    for (struct rip_route *r = routes; r != NULL; r = r->list_next) {
+        r->changed = 0;
+    }
+    trigger_pending = 0;
+}
+
+void rip_static(uint32_t prefix, uint32_t mask, uint32_t next_hop, int interface) {
+    struct rip_route *r = rip_lookup(prefix & mask, mask);
+
+    if (r == NULL) {
+        r = rip_add(prefix & mask, mask);
+    }
+    r->next_hop = next_hop;
+    r->interface = interface;
+    r->metric = 1;
+    r->source = RIP_STATIC;
+}
+
+void rip_init(struct trie_node *root, uint32_t interval_s) {
+    DIE(interval_s == 0, "Invalid RIP interval");
+
+    fib = root;
+    interval = interval_s * NSEC_PER_SEC;
+    route_timeout = RIP_TIMEOUT_INTERVALS * interval;
+    garbage_time = RIP_GARBAGE_INTERVALS * interval;
+    start = now_ns();
+    next_update = start; // advertise at once
+
+    for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+        link_up[i] = get_interface_running(i);
+        if (link_up[i]) {
+            send_request(i);
+        }
+    }
+}
+
+int rip_match(struct iphdr *ip_hdr, uint32_t router_addr) {
+    if (!rip_enabled || ip_hdr->protocol != IPPROTO_UDP) {
+        return 0;
+    }
+    if (ip_hdr->daddr != htonl(RIP_GROUP) && ip_hdr->daddr != router_addr) {
+        return 0;
+    }
+
+    struct udphdr *udp_hdr = (struct udphdr *)((char *)ip_hdr + ip_hdr->ihl * 4);
+    return ntohs(udp_hdr->dest) == RIP_PORT;
+}
+
+static void rip_learn(struct rip_entry *e, uint32_t sender, int interface, uint64_t now) {
+    uint32_t metric = ntohl(e->metric);
+    uint32_t mask = e->mask;
+
+    if (ntohs(e->family) != AF_INET || metric < 1 || metric > RIP_INFINITY) {
+        return;
+    }
+    if ((~ntohl(mask) & (~ntohl(mask) + 1)) != 0) {
+        return; // not a contiguous mask
+    }
+    metric = metric + 1 < RIP_INFINITY ? metric + 1 : RIP_INFINITY;
+
+    uint32_t prefix = e->addr & mask;
+    struct rip_route *r = rip_lookup(prefix, mask);
+
+    if (r == NULL) {
+        if (metric == RIP_INFINITY) {
+            return;
+        }
+        r = rip_add(prefix, mask);
+        r->source = RIP_LEARNED;
+    } else if (r->source == RIP_STATIC) {
+        return;
+    } else if (r->next_hop == sender && r->interface == interface) {
+        // Same neighbour: refresh, and follow its metric whichever way it goes
+        if (metric == RIP_INFINITY) {
+            if (r->garbage == 0) {
+                rip_withdraw(r, "withdraw", now);
+            }
+            return;
+        }
+        r->timeout = now + route_timeout;
+        if (metric == r->metric && r->garbage == 0) {
+            return;
+        }
+    } else if (metric >= r->metric) {
+        return;
+    }
+
+    r->next_hop = sender;
+    r->interface = interface;
+    r->metric = metric;
+    r->timeout = now + route_timeout;
+    r->garbage = 0;
+    insert_route(fib, r->prefix, r->mask, r->next_hop, r->interface);
+    rip_changed(r);
+    rip_log("update", r, now);
+}
+
+void rip_input(struct iphdr *ip_hdr, int interface, uint64_t now) {
+    struct udphdr *udp_hdr = (struct udphdr *)((char *)ip_hdr + ip_hdr->ihl * 4);
+    struct rip_header *rip_hdr = (struct rip_header *)(udp_hdr + 1);
+    int udp_len = ntohs(udp_hdr->len);
+
+    if (udp_len > ntohs(ip_hdr->tot_len) - ip_hdr->ihl * 4 ||
+        udp_len < (int)(sizeof(struct udphdr) + sizeof(struct rip_header))) {
+        return;
+    }
+    if (rip_hdr->version < RIP_VERSION || ip_hdr->saddr == inet_addr(get_interface_ip(interface))) {
+        return;
+    }
+
+    if (rip_hdr->command == RIP_REQUEST) {
+        send_update(interface, 0);
+        return;
+    }
+    if (rip_hdr->command != RIP_RESPONSE || ntohs(udp_hdr->source) != RIP_PORT) {
+        return;
+    }
+
+    int n = (udp_len - sizeof(struct udphdr) - sizeof(struct rip_header)) / sizeof(struct rip_entry);
+    struct rip_entry *entries = (struct rip_entry *)(rip_hdr + 1);
+    for (int i = 0; i < n; i++) {
+        rip_learn(&entries[i], ip_hdr->saddr, interface, now);
+    }
+}
+
+static void rip_sweep(uint64_t now) {
+    for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+        int running = get_interface_running(i);
+
+        if (link_up[i] && !running) {
+            printf("RIP interface%d down\n", i);
+            for (struct rip_route *r = routes; r != NULL; r = r->list_next) {
+                if (r->interface != i) {
+                    continue;
+                }
+                if (r->source == RIP_STATIC) {
+                    // Stays in the trie, but neighbours should route around it
+                    r->metric = RIP_INFINITY;
+                    rip_changed(r);
+                } else if (r->garbage == 0) {
+                    rip_withdraw(r, "link down", now);
+                }
+            }
+        } else if (!link_up[i] && running) {
+            printf("RIP interface%d up\n", i);
+            for (struct rip_route *r = routes; r != NULL; r = r->list_next) {
+                if (r->source == RIP_STATIC && r->interface == i) {
+                    r->metric = 1;
+                    rip_changed(r);
+                }
+            }
+            send_request(i);
+            send_update(i, 0);
+        }
+        link_up[i] = running;
+    }
+
+    struct rip_route **p = &routes;
+    while (*p != NULL) {
+        struct rip_route *r = *p;
+
+        if (r->source == RIP_LEARNED && r->garbage == 0 && now >= r->timeout) {
+            rip_withdraw(r, "expire", now);
+        } else if (r->garbage != 0 && now >= r->garbage) {
+            *p = r->list_next;
+            rip_unlink(r);
+            free(r);
+            continue;
+        }
+        p = &r->list_next;
+    }
+}
+
+void rip_tick(uint64_t now) {
+    if (!rip_enabled) {
+        return;
+    }
+
+    if (now >= next_sweep) {
+        rip_sweep(now);
+        next_sweep = now + NSEC_PER_SEC;
+    }
+
+    if (now >= next_update) {
+        send_updates(0);
+        // Jitter of up to a sixth of the interval keeps routers from synchronising
+        next_update = now + interval - interval / 12 + rand() % (interval / 6 + 1);
+    } else if (trigger_pending && now >= next_trigger) {
+        send_updates(1);
+        next_trigger = now + RIP_TRIGGER_HOLD * NSEC_PER_SEC;
+    }
+}
+
+void rip_dump(FILE *f) {
+    fprintf(f, "RIP routes\n");
+    for (struct rip_route *r = routes; r != NULL; r = r->list_next) {
+        char prefix[INET_ADDRSTRLEN], next_hop[INET_ADDRSTRLEN];
+
+        inet_ntop(AF_INET, &r->prefix, prefix, sizeof(prefix));
+        inet_ntop(AF_INET, &r->next_hop, next_hop, sizeof(next_hop));
+        fprintf(f, "  %s/%d via %s interface%d metric %d %s\n", prefix,
+                get_bit_count_from_mask(r->mask), next_hop, r->interface, r->metric,
+                r->source == RIP_STATIC ? "static" : r->garbage ? "garbage" : "learned");
+    }
+}
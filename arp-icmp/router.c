@@ -1,64 +1,274 @@
+#define _GNU_SOURCE /* sched_setaffinity */
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+
 #include "router.h"
+#include "acl.h"
+#include "capture.h"
+#include "egress.h"
+#include "flow.h"
+#include "latency.h"
+#include "mcast.h"
+#include "nat.h"
+#include "nexthop.h"
+#include "pktbuf.h"
+#include "policy.h"
 #include "queue.h"
+#include "ratelimit.h"
+#include "rip.h"
 #include "skel.h"
+#include "stats.h"
+#include "timeutil.h"
 #include "trie.h"
 
 struct trie_node *root;
 
-struct arp_entry *arp_table;
-int arp_table_size;
+int build_threads;
+
+int busy_poll_us;
+int forward_cpu = -1;
+
+char *policy_file;
+struct policy *policy;
+
+int mcast_enabled;
+
+char *arp_file;
+int arp_warmup;
+uint32_t arp_timeout = NEIGH_DEFAULT_TIMEOUT;
+
+uint32_t rip_interval = RIP_DEFAULT_INTERVAL;
+
+uint32_t nh_interval = NH_DEFAULT_INTERVAL;
+uint32_t nh_multiplier = NH_DEFAULT_MULTIPLIER;
+
+char *flow_collector;
+uint32_t flow_sampling = 1000;
+uint32_t flow_interval = FLOW_DEFAULT_INTERVAL;
+
+int arp_queue_len;
+
+char *stats_name;
+
+int nat_interface = -1;
+uint32_t nat_max_flows = NAT_DEFAULT_MAX_FLOWS;
+
+int egress_depth = EGRESS_DEFAULT_DEPTH;
+
+struct acl *acl;
+char *acl_file;
+
+volatile sig_atomic_t dump_requested;
+volatile sig_atomic_t reload_requested;
+volatile sig_atomic_t capture_requested;
+
+char *capture_prefix;
+char *capture_filter;
 
 int get_best_route(uint32_t dest_ip, uint32_t *next_hop) {
     return search_route(root, dest_ip, next_hop);
 }
 
+int get_policy_route(uint32_t src_ip, uint32_t dest_ip, int interface, uint32_t *next_hop) {
+    if (policy == NULL) {
+        return search_route(root, dest_ip, next_hop);
+    }
+    return policy_route(policy, root, src_ip, dest_ip, interface, next_hop);
+}
+
 struct arp_entry *get_arp_entry(uint32_t dest_ip) {
-    for (int i = 0; i < arp_table_size; i++) {
-        if (arp_table[i].ip == dest_ip) {
-            return &arp_table[i];
+    return neigh_lookup(dest_ip, now_ns());
+}
+
+struct rtable_chunk {
+    char *begin;                /* whole lines, NUL terminated */
+    char *end;
+    struct trie_route *routes;
+    uint32_t *backups;          /* backup next hop of each route, if any */
+    int *backup_interfaces;     /* -1 without a backup */
+    int n;
+};
+
+/* Parses the lines of one chunk of the rtable file */
+static void *parse_rtable_chunk(void *arg) {
+    struct rtable_chunk *c = arg;
+    int capacity = 0;
+
+    for (char *line = c->begin; line < c->end; line += strlen(line) + 1) {
+        char prefix_str[50], next_hop_str[50], mask_str[50], backup_str[50];
+        int interface, backup_interface;
+
+        // Read line (optionally followed by a backup next hop and interface)
+        int fields = sscanf(line, "%49s %49s %49s %d %49s %d", prefix_str, next_hop_str, mask_str,
+                            &interface, backup_str, &backup_interface);
+        if (fields < 4) {
+            continue;
         }
+
+        if (c->n == capacity) {
+            capacity = capacity ? 2 * capacity : 1024;
+            c->routes = realloc(c->routes, capacity * sizeof(struct trie_route));
+            c->backups = realloc(c->backups, capacity * sizeof(uint32_t));
+            c->backup_interfaces = realloc(c->backup_interfaces, capacity * sizeof(int));
+            DIE(c->routes == NULL || c->backups == NULL || c->backup_interfaces == NULL,
+                "memory");
+        }
+        struct trie_route *r = &c->routes[c->n];
+        r->prefix = inet_addr(prefix_str);
+        r->mask = inet_addr(mask_str);
+        r->next_hop = inet_addr(next_hop_str);
+        r->interface = interface;
+        r->group = NULL;
+        c->backups[c->n] = fields == 6 ? inet_addr(backup_str) : 0;
+        c->backup_interfaces[c->n] = fields == 6 ? backup_interface : -1;
+        c->n++;
     }
     return NULL;
 }
 
-void read_rtable(char *filename) {
+/* Reads a routing table file into a new trie; routes of the main table are
+ * also announced by RIP */
+static struct trie_node *load_rtable(char *filename, int main_table) {
     FILE *f;
     f = fopen(filename, "r");
     DIE(f == NULL, "Failed to open rtable file");
-    printf("Parsing routing table\n");
+    printf("Parsing routing table %s\n", filename);
+    uint64_t start = now_ns();
+
+    // Read the whole file and cut it into one chunk of lines per thread
+    DIE(fseek(f, 0, SEEK_END) < 0, "fseek");
+    long size = ftell(f);
+    rewind(f);
+    char *text = malloc(size + 1);
+    DIE(text == NULL, "memory");
+    DIE(fread(text, 1, size, f) != (size_t)size, "Failed to read rtable file");
+    fclose(f);
+    text[size] = '\0';
+    for (char *nl = memchr(text, '\n', size); nl != NULL; nl = memchr(nl, '\n', text + size - nl)) {
+        *nl++ = '\0';
+    }
 
-    // Initialise trie structure
-    init_trie(&root, -1, 0);
+    int chunks = build_threads < TRIE_MAX_THREADS ? build_threads : TRIE_MAX_THREADS;
+    struct rtable_chunk chunk[TRIE_MAX_THREADS];
+    pthread_t parsers[TRIE_MAX_THREADS];
+    char *begin = text;
+    memset(chunk, 0, sizeof(chunk));
+    for (int i = 0; i < chunks; i++) {
+        char *end = text + size * (i + 1) / chunks;
+        chunk[i].begin = chunk[i].end = begin;
+        if (end < begin) {
+            continue; // the previous line already covers this chunk
+        }
+        chunk[i].end = end + strlen(end); // stop at the end of a line
+        begin = chunk[i].end < text + size ? chunk[i].end + 1 : chunk[i].end;
+    }
+    for (int i = 1; i < chunks; i++) {
+        DIE(pthread_create(&parsers[i], NULL, parse_rtable_chunk, &chunk[i]) != 0,
+            "pthread_create");
+    }
+    parse_rtable_chunk(&chunk[0]);
 
-    char line[200];
-    while (fgets(line, sizeof(line), f)) {
-        char prefix_str[50], next_hop_str[50], mask_str[50];
-        int interface;
+    // Next-hop groups and RIP are not thread safe: resolve them in file order
+    int n = 0;
+    for (int i = 0; i < chunks; i++) {
+        if (i > 0) {
+            pthread_join(parsers[i], NULL);
+        }
+        n += chunk[i].n;
+    }
+    struct trie_route *routes = malloc((n + 1) * sizeof(struct trie_route));
+    DIE(routes == NULL, "memory");
+    n = 0;
+    for (int i = 0; i < chunks; i++) {
+        for (int j = 0; j < chunk[i].n; j++) {
+            struct trie_route *r = &routes[n++];
+            *r = chunk[i].routes[j];
+            if (chunk[i].backup_interfaces[j] != -1) {
+                r->group = nh_group_get(r->next_hop, r->interface, chunk[i].backups[j],
+                                        chunk[i].backup_interfaces[j]);
+            }
+            if (main_table && rip_enabled) {
+                rip_static(r->prefix, r->mask, r->next_hop, r->interface);
+            }
+        }
+        free(chunk[i].routes);
+        free(chunk[i].backups);
+        free(chunk[i].backup_interfaces);
+    }
+    free(text);
+
+    // Insert to trie, all routes at once
+    struct trie_node *root = build_trie(routes, n, build_threads);
+    free(routes);
+
+    printf("Route table successfully read (%d routes, %llu ms)\n", n,
+           (now_ns() - start) / NSEC_PER_MSEC);
+    return root;
+}
 
-        // Read line
-        sscanf(line, "%s %s %s %d", prefix_str, next_hop_str, mask_str, &interface);
-        uint32_t prefix = inet_addr(prefix_str);
-        uint32_t mask = inet_addr(mask_str);
-        uint32_t next_hop = inet_addr(next_hop_str);
+static struct trie_node *load_policy_table(char *filename) {
+    return load_rtable(filename, 0);
+}
 
-        // Insert to trie
-        insert_route(root, prefix, mask, next_hop, interface);
+void read_rtable(char *filename) {
+    root = load_rtable(filename, 1);
+    if (policy_file != NULL) {
+        policy = policy_load(policy_file, load_policy_table);
+        DIE(policy == NULL, "Failed to load policy rules");
     }
+}
 
-    fclose(f);
-    printf("Route table successfully read\n");
+void send_fragments(packet *m, int interface, int mtu) {
+    struct iphdr *ip_hdr = (struct iphdr *)(m->payload + sizeof(struct ether_header));
+    int hdr_len = sizeof(struct ether_header) + ip_hdr->ihl * 4;
+    int data_len = ntohs(ip_hdr->tot_len) - ip_hdr->ihl * 4;
+    int chunk = (mtu - ip_hdr->ihl * 4) & ~7; // offsets count 8-byte units
+    int offset = (ntohs(ip_hdr->frag_off) & IP_OFFMASK) * 8;
+    int more = ntohs(ip_hdr->frag_off) & IP_MF;
+
+    char buf[MAX_LEN];
+    packet frag = { .payload = buf, .interface = m->interface };
+    struct iphdr *frag_hdr = (struct iphdr *)(buf + sizeof(struct ether_header));
+
+    for (int done = 0; done < data_len; done += chunk) {
+        int len = data_len - done < chunk ? data_len - done : chunk;
+
+        // Every fragment carries the Ethernet and IP headers (options included)
+        memcpy(buf, m->payload, hdr_len);
+        memcpy(buf + hdr_len, m->payload + hdr_len + done, len);
+        frag_hdr->tot_len = htons(ip_hdr->ihl * 4 + len);
+        frag_hdr->frag_off = htons((offset + done) / 8 |
+                                   (done + len < data_len || more ? IP_MF : 0));
+        frag_hdr->check = 0;
+        frag_hdr->check = ip_checksum(frag_hdr, ip_hdr->ihl * 4);
+        frag.len = hdr_len + len;
+
+        egress_send(interface, &frag);
+    }
 }
 
 void update_eth_hdr_and_send(packet *m, int interface, uint8_t *dhost) {
     struct ether_header *eth_hdr = (struct ether_header *)m->payload;
+    struct iphdr *ip_hdr = (struct iphdr *)(m->payload + sizeof(struct ether_header));
 
     // Update Ethernet address
     get_interface_mac(interface, eth_hdr->ether_shost);
     memcpy(eth_hdr->ether_dhost, dhost, ETH_ALEN);
 
-    // Forward the packet to interface
+    // Packets with DF set were refused before reaching this point
+    int mtu = get_interface_mtu(interface);
+    if (ntohs(eth_hdr->ether_type) == ETHERTYPE_IP && ntohs(ip_hdr->tot_len) > mtu) {
+        printf("Fragmenting packet for interface%d\n", interface);
+        send_fragments(m, interface, mtu);
+        return;
+    }
+
+    // Forward the packet to interface (queued by DSCP class under congestion)
     printf("Sending packet on interface%d\n", interface);
-    send_packet(interface, m);
+    egress_send(interface, m);
 }
 
 uint16_t add(uint16_t a, uint16_t b) {
@@ -70,36 +280,321 @@ uint16_t ip_checksum_incremental(uint16_t old_checksum, uint16_t old_field, uint
     return ~add(add(~old_checksum, ~old_field), new_field);
 }
 
+int parse_options(int argc, char *argv[]) {
+    uint64_t icmp_rate = ICMP_DEFAULT_RATE, icmp_burst = ICMP_DEFAULT_BURST;
+    uint64_t icmp_if_rate = ICMP_DEFAULT_IF_RATE, icmp_if_burst = ICMP_DEFAULT_IF_BURST;
+
+    static struct option long_options[] = {
+        {"icmp-rate", required_argument, NULL, 'r'},
+        {"icmp-burst", required_argument, NULL, 'b'},
+        {"icmp-if-rate", required_argument, NULL, 'R'},
+        {"icmp-if-burst", required_argument, NULL, 'B'},
+        {"copp", required_argument, NULL, 'o'},
+        {"copp-src", required_argument, NULL, 'O'},
+        {"stats-name", required_argument, NULL, 's'},
+        {"latency", no_argument, NULL, 'l'},
+        {"acl", required_argument, NULL, 'a'},
+        {"nat-outside", required_argument, NULL, 'n'},
+        {"nat-max-flows", required_argument, NULL, 'N'},
+        {"egress-depth", required_argument, NULL, 'q'},
+        {"rx-burst", required_argument, NULL, 'x'},
+        {"arp-table", required_argument, NULL, 'A'},
+        {"arp-warmup", no_argument, NULL, 'w'},
+        {"arp-timeout", required_argument, NULL, 'T'},
+        {"rip", no_argument, NULL, 'P'},
+        {"rip-interval", required_argument, NULL, 'I'},
+        {"nh-interval", required_argument, NULL, 'i'},
+        {"nh-multiplier", required_argument, NULL, 'm'},
+        {"flow-collector", required_argument, NULL, 'c'},
+        {"flow-rate", required_argument, NULL, 'S'},
+        {"flow-interval", required_argument, NULL, 'E'},
+        {"capture", required_argument, NULL, 'C'},
+        {"capture-filter", required_argument, NULL, 'F'},
+        {"policy", required_argument, NULL, 'p'},
+        {"build-threads", required_argument, NULL, 'j'},
+        {"busy-poll", required_argument, NULL, 'u'},
+        {"cpu", required_argument, NULL, 'k'},
+        {"mcast", required_argument, NULL, 'M'},
+        {0, 0, 0, 0}
+    };
+
+    copp_init();
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "r:b:R:B:o:O:s:la:n:N:q:x:A:wT:PI:i:m:c:S:E:C:F:p:j:u:k:M:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'r':
+                icmp_rate = strtoull(optarg, NULL, 10);
+                break;
+            case 'b':
+                icmp_burst = strtoull(optarg, NULL, 10);
+                break;
+            case 'R':
+                icmp_if_rate = strtoull(optarg, NULL, 10);
+                break;
+            case 'B':
+                icmp_if_burst = strtoull(optarg, NULL, 10);
+                break;
+            case 'o':
+                DIE(copp_parse(optarg, 0) < 0, "Invalid control-plane policer");
+                break;
+            case 'O':
+                DIE(copp_parse(optarg, 1) < 0, "Invalid control-plane policer");
+                break;
+            case 's':
+                stats_name = optarg;
+                break;
+            case 'l':
+                latency_init();
+                break;
+            case 'a':
+                acl_file = optarg;
+                acl = acl_load(acl_file);
+                DIE(acl == NULL, "Failed to load ACL");
+                break;
+            case 'n':
+                nat_interface = atoi(optarg);
+                DIE(nat_interface < 0 || nat_interface >= ROUTER_NUM_INTERFACES,
+                    "Invalid NAT interface");
+                break;
+            case 'N':
+                nat_max_flows = strtoul(optarg, NULL, 10);
+                break;
+            case 'q':
+                egress_depth = atoi(optarg);
+                break;
+            case 'x': {
+                // One burst for every interface, or a comma-separated list
+                char *burst = strtok(optarg, ",");
+                for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+                    set_rx_burst(i, atoi(burst));
+                    burst = strtok(NULL, ",") ?: burst;
+                }
+            } break;
+            case 'A':
+                arp_file = optarg;
+                break;
+            case 'w':
+                arp_warmup = 1;
+                break;
+            case 'T':
+                arp_timeout = strtoul(optarg, NULL, 10);
+                break;
+            case 'P':
+                rip_enabled = 1;
+                break;
+            case 'I':
+                rip_interval = strtoul(optarg, NULL, 10);
+                break;
+            case 'i':
+                nh_interval = strtoul(optarg, NULL, 10);
+                break;
+            case 'm':
+                nh_multiplier = strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                flow_collector = optarg;
+                break;
+            case 'S':
+                flow_sampling = strtoul(optarg, NULL, 10);
+                break;
+            case 'E':
+                flow_interval = strtoul(optarg, NULL, 10);
+                break;
+            case 'C':
+                capture_prefix = optarg;
+                break;
+            case 'F':
+                capture_filter = optarg;
+                break;
+            case 'p':
+                policy_file = optarg;
+                break;
+            case 'j':
+                build_threads = atoi(optarg);
+                break;
+            case 'u':
+                busy_poll_us = atoi(optarg);
+                break;
+            case 'k':
+                forward_cpu = atoi(optarg);
+                break;
+            case 'M':
+                DIE(mcast_load(optarg) < 0, "Failed to load multicast routes");
+                mcast_enabled = 1;
+                break;
+            default:
+                DIE(1, "Unknown option");
+        }
+    }
+
+    if (build_threads <= 0) {
+        build_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    icmp_limit_init(icmp_rate, icmp_burst, icmp_if_rate, icmp_if_burst);
+    egress_init(egress_depth);
+    neigh_init(arp_timeout);
+    nh_init(nh_interval, nh_multiplier);
+    if (flow_collector != NULL) {
+        flow_init(flow_collector, flow_sampling, flow_interval);
+    }
+
+    return optind;
+}
+
+void router_tick(uint64_t now) {
+    nat_tick(now);
+    neigh_tick(now);
+    rip_tick(now);
+    nh_tick(now);
+    flow_tick(now);
+}
+
+void on_signal(int sig) {
+    if (sig == SIGUSR1) {
+        dump_requested = 1;
+    } else if (sig == SIGHUP) {
+        reload_requested = 1;
+    } else if (sig == SIGUSR2) {
+        capture_requested = 1;
+    }
+}
+
+void handle_signals(void) {
+    if (capture_requested) {
+        capture_requested = 0;
+        capture_toggle();
+    }
+
+    if (dump_requested) {
+        dump_requested = 0;
+        if (latency_enabled) {
+            latency_dump(stderr);
+        }
+        if (acl != NULL) {
+            acl_dump(acl, stderr);
+        }
+        if (policy != NULL) {
+            policy_dump(policy, stderr);
+        }
+        if (mcast_enabled) {
+            mcast_dump(stderr);
+        }
+        if (rip_enabled) {
+            rip_dump(stderr);
+        }
+        if (nh_enabled()) {
+            nh_dump(stderr);
+        }
+    }
+
+    if (reload_requested) {
+        reload_requested = 0;
+        if (acl_file != NULL) {
+            struct acl *fresh = acl_load(acl_file);
+            if (fresh == NULL) {
+                fprintf(stderr, "ACL reload failed, keeping the current rules\n");
+            } else {
+                // The forwarding loop is the only reader, so the old
+                // classifier is unused once the pointer is swapped
+                struct acl *old = __atomic_exchange_n(&acl, fresh, __ATOMIC_ACQ_REL);
+                acl_free(old);
+            }
+        }
+    }
+}
+
 int main(int argc, char *argv[]) {
-    packet m;
+    // Pooled, so multicast replicas can keep referencing it after the loop
+    // moves on (see mcast_forward)
+    packet m = { .payload = pktbuf_alloc(MAX_LEN) };
     int rc;
 
-    DIE(argc != 5, "Wrong number of arguments");
+    // Usage: ./router [options] rtable interface...
+    int first_arg = parse_options(argc, argv);
+    DIE(argc - first_arg != ROUTER_NUM_INTERFACES + 1, "Wrong number of arguments");
 
     // Initialization
-    init(argc - 2, argv + 2);
+    init(argc - first_arg - 1, argv + first_arg + 1);
     setvbuf(stdout, NULL, _IONBF, 0);
-    arp_table = malloc(sizeof(struct arp_entry) * MAX_TABLE_SIZE);
-    DIE(arp_table == NULL, "memory");
-    read_rtable(argv[1]);
+    stats_init(stats_name, argv + first_arg + 1, ROUTER_NUM_INTERFACES);
+    if (capture_prefix != NULL) {
+        capture_init(capture_prefix, capture_filter, argv + first_arg + 1);
+    }
+    if (arp_file != NULL) {
+        parse_arp_table(arp_file);
+    }
+    read_rtable(argv[first_arg]);
+    if (arp_warmup) {
+        neigh_warmup(root);
+    }
+    if (rip_enabled) {
+        rip_init(root, rip_interval);
+    }
+    if (forward_cpu >= 0) {
+        // After the table build, which uses every core
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(forward_cpu, &cpus);
+        DIE(sched_setaffinity(0, sizeof(cpus), &cpus) < 0, "sched_setaffinity");
+        printf("Forwarding pinned to CPU %d\n", forward_cpu);
+    }
+    if (busy_poll_us > 0) {
+        set_rx_busy_poll(busy_poll_us);
+    }
+    // Liveness probes need the loop to wake up at least once per interval
+    set_rx_timeout(nh_enabled() && nh_interval < ROUTER_TICK_MS ? nh_interval : ROUTER_TICK_MS);
+    if (nat_interface >= 0) {
+        nat_init(nat_interface, inet_addr(get_interface_ip(nat_interface)), nat_max_flows);
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
 
     queue q = queue_create();
 
     while (1) {
+        if (dump_requested || reload_requested || capture_requested) {
+            handle_signals();
+        }
+
         rc = get_packet(&m);
+        if (rc < 0 && (errno == EINTR || errno == ETIMEDOUT)) {
+            router_tick(now_ns());
+            continue;
+        }
         DIE(rc < 0, "get_message");
+        lat_begin();
+        router_tick(now_ns());
 
         struct ether_header *eth_hdr = (struct ether_header *)m.payload;
         struct iphdr *ip_hdr = (struct iphdr *)(m.payload + sizeof(struct ether_header));
 
         uint32_t router_addr = inet_addr(get_interface_ip(m.interface));
 
+        // Police traffic for the router itself before doing any work for it
+        if (!copp_allow(m.payload, m.len, router_addr)) {
+            printf("Control plane policed\n");
+            continue;
+        }
+
         // Check if packet is ICMP echo request
         struct icmphdr *icmp_hdr = parse_icmp(m.payload);
 
         if (icmp_hdr != NULL) {
+            if (ip_hdr->daddr == router_addr && nh_input(ip_hdr, icmp_hdr, now_ns())) {
+                continue; // next-hop liveness probe answered
+            }
             if (icmp_hdr->type == ICMP_ECHO && ip_hdr->daddr == router_addr) {
                 printf("Received router ICMP echo request\n");
+                if (!icmp_limit_allow(ICMP_CLASS_ECHO_REPLY, m.interface)) {
+                    printf("ICMP echo reply rate limited\n");
+                    continue;
+                }
                 send_icmp(ip_hdr->saddr, router_addr, eth_hdr->ether_dhost, eth_hdr->ether_shost,
                           ICMP_ECHOREPLY, 0, m.interface,
                           getpid(), icmp_hdr->un.echo.sequence);
@@ -136,19 +631,25 @@ int main(int argc, char *argv[]) {
             } else if (ntohs(arp_hdr->op) == ARPOP_REPLY) {
                 // Add entry to ARP table
                 printf("Received ARP reply\n");
-                arp_table[arp_table_size].ip = arp_hdr->spa;
-                memcpy(arp_table[arp_table_size].mac, arp_hdr->sha, ETH_ALEN);
-                arp_table_size++;
-
-                if (!queue_empty(q)) {
-                    // Dequeue and send packet
+                neigh_update(arp_hdr->spa, arp_hdr->sha, m.interface, now_ns());
+
+                // Send the packets waiting for this neighbour
+                int waiting = arp_queue_len;
+                for (int i = 0; i < waiting; i++) {
+                    struct queue_entry *q_entry = queue_deq(q);
+                    if (q_entry->next_hop != arp_hdr->spa) {
+                        queue_enq(q, q_entry);
+                        continue;
+                    }
                     printf("Dequeueing packet\n");
+                    arp_queue_len--;
+                    update_eth_hdr_and_send(&(q_entry->m), q_entry->interface, arp_hdr->sha);
+                    pktbuf_free(q_entry->m.payload);
+                    free(q_entry);
+                }
 
-                    struct queue_entry q_entry;
-                    memcpy(&q_entry, (struct queue_entry *)queue_deq(q), sizeof(struct queue_entry));
-                    update_eth_hdr_and_send(&(q_entry.m), q_entry.interface, arp_hdr->sha);
+                if (arp_hdr->tpa == router_addr)
                     continue;
-                }
 
                 // Forward ARP reply if not for this router
                 uint32_t next_hop;
@@ -163,22 +664,66 @@ int main(int argc, char *argv[]) {
             continue;
         }
 
-        // Check the checksum
-        uint16_t packet_check = ip_hdr->check;
-        ip_hdr->check = 0;
-        uint16_t received_check = ip_checksum(ip_hdr, sizeof(struct iphdr));
-        if (packet_check == received_check) {
-            printf("Checksum OK\n");
+        // Check the checksum, unless the kernel already did
+        stats_csum(m.csum_valid);
+        if (m.csum_valid) {
+            printf("Checksum OK (offloaded)\n");
         } else {
-            printf("Checksum ERROR %d %d\n", packet_check, received_check);
+            uint16_t packet_check = ip_hdr->check;
+            ip_hdr->check = 0;
+            uint16_t received_check = ip_checksum(ip_hdr, sizeof(struct iphdr));
+            if (packet_check == received_check) {
+                printf("Checksum OK\n");
+                ip_hdr->check = packet_check;
+            } else {
+                printf("Checksum ERROR %d %d\n", packet_check, received_check);
+                stats_drop(DROP_BAD_CHECKSUM);
+                continue;
+            }
+        }
+
+        // Routing protocol messages
+        if (rip_match(ip_hdr, router_addr)) {
+            rip_input(ip_hdr, m.interface, now_ns());
+            continue;
+        }
+
+        // Reverse-translate replies to NATed flows
+        if (m.interface == nat_outside && !IN_MULTICAST(ntohl(ip_hdr->daddr)) &&
+            nat_inbound(ip_hdr) < 0) {
+            printf("No NAT flow\n");
+            stats_drop(DROP_NAT);
+            continue;
+        }
+
+        // Filter transit traffic
+        if (acl != NULL) {
+            struct acl_key key;
+            acl_packet_key(ip_hdr, &key);
+            if (acl_classify(acl, &key) == ACL_DENY) {
+                printf("Denied by ACL\n");
+                stats_drop(DROP_ACL);
+                continue;
+            }
+        }
+
+        // Multicast is replicated to the interfaces of its static route
+        if (mcast_enabled && IN_MULTICAST(ntohl(ip_hdr->daddr))) {
+            mcast_forward(&m);
             continue;
         }
 
         // Check TTL > 1
         if (ip_hdr->ttl > 1) {
             printf("TTL OK\n");
+            lat_mark(LAT_CLASSIFY);
         } else {
             printf("TTL ERROR\n");
+            stats_drop(DROP_TTL);
+            if (!icmp_limit_allow(ICMP_CLASS_TIME_EXCEEDED, m.interface)) {
+                printf("ICMP time exceeded rate limited\n");
+                continue;
+            }
             get_interface_mac(m.interface, eth_hdr->ether_dhost);
             send_icmp_error(ip_hdr->saddr, router_addr, eth_hdr->ether_dhost, eth_hdr->ether_shost,
                       ICMP_TIME_EXCEEDED, ICMP_EXC_TTL, m.interface);
@@ -187,42 +732,80 @@ int main(int argc, char *argv[]) {
 
         // Find best matching route
         uint32_t next_hop;
-        int next_interface = get_best_route(ip_hdr->daddr, &next_hop);
+        int next_interface = get_policy_route(ip_hdr->saddr, ip_hdr->daddr, m.interface,
+                                              &next_hop);
+        lat_mark(LAT_LPM);
         if (next_interface == -1) {
             printf("Route not found\n");
+            stats_drop(DROP_NO_ROUTE);
+            if (!icmp_limit_allow(ICMP_CLASS_DEST_UNREACH, m.interface)) {
+                printf("ICMP destination unreachable rate limited\n");
+                continue;
+            }
             get_interface_mac(m.interface, eth_hdr->ether_dhost);
             send_icmp_error(ip_hdr->saddr, router_addr, eth_hdr->ether_dhost, eth_hdr->ether_shost,
                       ICMP_DEST_UNREACH, ICMP_NET_UNREACH, m.interface);
             continue;
         }
 
+        // Refuse packets that do not fit the egress MTU and may not be fragmented
+        int mtu = get_interface_mtu(next_interface);
+        if (ntohs(ip_hdr->tot_len) > mtu && (ntohs(ip_hdr->frag_off) & IP_DF)) {
+            printf("Fragmentation needed\n");
+            stats_drop(DROP_MTU);
+            if (!icmp_limit_allow(ICMP_CLASS_DEST_UNREACH, m.interface)) {
+                printf("ICMP fragmentation needed rate limited\n");
+                continue;
+            }
+            get_interface_mac(m.interface, eth_hdr->ether_dhost);
+            send_icmp_frag_needed(ip_hdr->saddr, router_addr, eth_hdr->ether_dhost, eth_hdr->ether_shost,
+                                  ip_hdr, mtu, m.interface);
+            continue;
+        }
+
+        // Account one packet in N to its flow
+        flow_sample(ip_hdr, m.interface, next_interface);
+
+        // Source NAT towards the outside interface
+        if (next_interface == nat_outside && m.interface != nat_outside &&
+            nat_outbound(ip_hdr) < 0) {
+            printf("NAT failed\n");
+            stats_drop(DROP_NAT);
+            continue;
+        }
+
         // Update TTL and recalculate the checksum using RFC 1624
         ip_hdr->ttl--;
-        ip_hdr->check = ip_checksum_incremental(packet_check, ip_hdr->ttl + 1, ip_hdr->ttl);
+        ip_hdr->check = ip_checksum_incremental(ip_hdr->check, ip_hdr->ttl + 1, ip_hdr->ttl);
 
         // Find matching ARP entry
         struct arp_entry *arp_entry = get_arp_entry(next_hop);
+        lat_mark(LAT_NEIGH);
 
         if (arp_entry == NULL) {
+            if (arp_queue_len >= ARP_QUEUE_MAX) {
+                printf("ARP queue full\n");
+                stats_drop(DROP_ARP_QUEUE_FULL);
+                continue;
+            }
+
             // Enqueue packet
             printf("Enqueueing packet\n");
-            struct queue_entry q_entry;
-            memcpy(&(q_entry.m), &m, sizeof(packet));
-            q_entry.interface = next_interface;
-            queue_enq(q, &q_entry);
+            struct queue_entry *q_entry = malloc(sizeof(struct queue_entry));
+            DIE(q_entry == NULL, "memory");
+            pktbuf_clone(&(q_entry->m), &m);
+            q_entry->interface = next_interface;
+            q_entry->next_hop = next_hop;
+            queue_enq(q, q_entry);
+            arp_queue_len++;
 
             // Send ARP request
             printf("Sending ARP request on interface%d\n", next_interface);
-
-            eth_hdr->ether_type = htons(ETHERTYPE_ARP);
-            get_interface_mac(next_interface, eth_hdr->ether_shost);
-            memset(eth_hdr->ether_dhost, 0xff, ETH_ALEN); // broadcast
-
-            uint32_t next_interface_addr = inet_addr(get_interface_ip(next_interface));
-            send_arp(next_hop, next_interface_addr, eth_hdr, next_interface, ARPOP_REQUEST);
+            neigh_probe(next_hop, next_interface);
             continue;
         }
 
         update_eth_hdr_and_send(&m, next_interface, arp_entry->mac);
+        lat_end(LAT_TX);
     }
 }
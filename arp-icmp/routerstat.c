@@ -0,0 +1,134 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "stats.h"
+
+/*
+ * routerstat - prints the counters exported by a running router.
+ * Usage: ./routerstat <router pid | segment name> [interval]
+ * The segment is mapped read-only, so the data path is never disturbed.
+ */
+
+/* Sums the counters of all registered threads */
+static void collect(const struct stats_segment *seg, struct thread_stats *total) {
+    uint32_t n_threads = __atomic_load_n(&seg->n_threads, __ATOMIC_ACQUIRE);
+    if (n_threads > STATS_MAX_THREADS) {
+        n_threads = STATS_MAX_THREADS;
+    }
+
+    memset(total, 0, sizeof(*total));
+    for (uint32_t t = 0; t < n_threads; t++) {
+        const struct thread_stats *ts = &seg->threads[t];
+
+        for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+            total->ifs[i].rx_packets += ts->ifs[i].rx_packets;
+            total->ifs[i].rx_bytes += ts->ifs[i].rx_bytes;
+            total->ifs[i].tx_packets += ts->ifs[i].tx_packets;
+            total->ifs[i].tx_bytes += ts->ifs[i].tx_bytes;
+            for (int c = 0; c < ICMP_CLASS_MAX; c++) {
+                total->icmp_suppressed[i][c] += ts->icmp_suppressed[i][c];
+            }
+            for (int c = 0; c < EGRESS_CLASSES; c++) {
+                total->egress_drops[i][c] += ts->egress_drops[i][c];
+            }
+        }
+        for (int d = 0; d < DROP_MAX; d++) {
+            total->drops[d] += ts->drops[d];
+        }
+        total->csum_offloaded += ts->csum_offloaded;
+        total->csum_software += ts->csum_software;
+        for (int c = 0; c < COPP_CLASS_MAX; c++) {
+            total->copp_passed[c] += ts->copp_passed[c];
+            total->copp_dropped[c] += ts->copp_dropped[c];
+        }
+    }
+}
+
+static void print_stats(const struct stats_segment *seg, const struct thread_stats *cur,
+                        const struct thread_stats *prev, double interval) {
+    printf("router pid %d, %u thread(s)\n", seg->pid, seg->n_threads);
+    printf("%-10s %14s %14s %14s %14s %12s %12s\n", "interface", "rx_packets", "rx_bytes",
+           "tx_packets", "tx_bytes", "rx_pps", "tx_pps");
+
+    for (uint32_t i = 0; i < seg->n_interfaces && i < ROUTER_NUM_INTERFACES; i++) {
+        const struct if_counters *c = &cur->ifs[i];
+        const struct if_counters *p = &prev->ifs[i];
+        printf("%-10s %14lu %14lu %14lu %14lu %12.0f %12.0f\n", seg->if_names[i],
+               c->rx_packets, c->rx_bytes, c->tx_packets, c->tx_bytes,
+               (c->rx_packets - p->rx_packets) / interval,
+               (c->tx_packets - p->tx_packets) / interval);
+    }
+
+    printf("drops:");
+    for (int d = 0; d < DROP_MAX; d++) {
+        printf(" %s=%lu", drop_reason_names[d], cur->drops[d]);
+    }
+    printf("\n");
+
+    printf("checksum: offloaded=%lu software=%lu\n", cur->csum_offloaded, cur->csum_software);
+
+    printf("control plane (passed/dropped):");
+    for (int c = 0; c < COPP_CLASS_MAX; c++) {
+        printf(" %s=%lu/%lu", copp_class_names[c], cur->copp_passed[c], cur->copp_dropped[c]);
+    }
+    printf("\n");
+
+    printf("icmp suppressed:");
+    for (int c = 0; c < ICMP_CLASS_MAX; c++) {
+        uint64_t sum = 0;
+        for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+            sum += cur->icmp_suppressed[i][c];
+        }
+        printf(" %s=%lu", icmp_class_names[c], sum);
+    }
+    printf("\n");
+
+    printf("egress queue drops:");
+    for (int c = 0; c < EGRESS_CLASSES; c++) {
+        uint64_t sum = 0;
+        for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+            sum += cur->egress_drops[i][c];
+        }
+        printf(" %s=%lu", egress_class_names[c], sum);
+    }
+    printf("\n\n");
+}
+
+int main(int argc, char *argv[]) {
+    char name[64];
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <router pid | segment name> [interval]\n", argv[0]);
+        return 1;
+    }
+
+    if (argv[1][0] == '/') {
+        snprintf(name, sizeof(name), "%s", argv[1]);
+    } else {
+        snprintf(name, sizeof(name), STATS_NAME_FORMAT, atoi(argv[1]));
+    }
+    int interval = argc > 2 ? atoi(argv[2]) : 0;
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    DIE(fd < 0, "shm_open");
+    struct stats_segment *seg = mmap(NULL, sizeof(struct stats_segment), PROT_READ,
+                                     MAP_SHARED, fd, 0);
+    DIE(seg == MAP_FAILED, "mmap");
+    close(fd);
+
+    DIE(__atomic_load_n(&seg->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC ||
+        seg->version != STATS_VERSION, "Not a router statistics segment");
+
+    struct thread_stats cur, prev;
+    collect(seg, &prev);
+    print_stats(seg, &prev, &prev, 1);
+
+    while (interval > 0) {
+        sleep(interval);
+        collect(seg, &cur);
+        print_stats(seg, &cur, &prev, interval);
+        prev = cur;
+    }
+
+    munmap(seg, sizeof(struct stats_segment));
+    return 0;
+}
@@ -1,6 +1,16 @@
 #include "skel.h"
+#include "capture.h"
+#include "egress.h"
+#include "stats.h"
+#include "timeutil.h"
+#include <errno.h>
+
+#ifndef TP_STATUS_CSUM_VALID
+#define TP_STATUS_CSUM_VALID (1 << 7)
+#endif
 
 int interfaces[ROUTER_NUM_INTERFACES];
+static int interface_mtu[ROUTER_NUM_INTERFACES];
 
 int get_sock(const char *if_name)
 {
@@ -20,18 +30,59 @@ int get_sock(const char *if_name)
 
 	res = bind(s , (struct sockaddr *)&addr , sizeof(addr));
 	DIE(res == -1, "bind");
+
+	/* ask for the checksum status of received frames */
+	int one = 1;
+	res = setsockopt(s, SOL_PACKET, PACKET_AUXDATA, &one, sizeof(one));
+	DIE(res == -1, "setsockopt PACKET_AUXDATA");
 	return s;
 }
 
-packet* socket_receive_message(int sockfd, packet *m)
+/*
+ * Non-blocking receive: returns 0 and fills m, or -1 if the socket has
+ * nothing to read
+ */
+int socket_receive_message(int sockfd, packet *m)
 {        
 	/* 
 	 * Note that "buffer" should be at least the MTU size of the 
 	 * interface, eg 1500 bytes 
 	 * */
-	m->len = read(sockfd, m->payload, MAX_LEN);
-	DIE(m->len == -1, "read");
-	return m;
+	char cbuf[CMSG_SPACE(sizeof(struct tpacket_auxdata))];
+	struct iovec iov = { .iov_base = m->payload, .iov_len = MAX_LEN };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+	};
+
+	while (1) {
+		msg.msg_controllen = sizeof(cbuf);
+		m->len = recvmsg(sockfd, &msg, MSG_DONTWAIT | MSG_TRUNC);
+		if (m->len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return -1;
+		/* the link went down under us; routing notices from its flags */
+		if (m->len == -1 && errno == ENETDOWN)
+			return -1;
+		DIE(m->len == -1, "recv");
+		if (m->len <= MAX_LEN) {
+			m->csum_valid = 0;
+			struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+			if (c != NULL && c->cmsg_level == SOL_PACKET &&
+			    c->cmsg_type == PACKET_AUXDATA) {
+				struct tpacket_auxdata *aux = (void *)CMSG_DATA(c);
+				/*
+				 * CSUMNOTREADY marks frames from a local stack (veth,
+				 * tap) that never crossed a wire
+				 */
+				m->csum_valid = !!(aux->tp_status &
+					(TP_STATUS_CSUM_VALID | TP_STATUS_CSUMNOTREADY));
+			}
+			return 0;
+		}
+		/* truncated: larger than any MTU we forward */
+		stats_drop(DROP_MTU);
+	}
 }
 
 int send_packet(int sockfd, packet *m)
@@ -42,30 +93,155 @@ int send_packet(int sockfd, packet *m)
 	 * */
 	int ret;
 	ret = write(interfaces[sockfd], m->payload, m->len);
-	DIE(ret == -1, "write");
+	if (ret == -1) {
+		stats_drop(DROP_TX_ERROR);
+		return -1;
+	}
+	stats_tx(sockfd, ret);
+	capture_tap(m->payload, m->len, sockfd);
 	return ret;
 }
 
+/* RX scheduler state: interfaces known to be readable and their quotas */
+static int rx_burst[ROUTER_NUM_INTERFACES] = {
+	[0 ... ROUTER_NUM_INTERFACES - 1] = RX_DEFAULT_BURST
+};
+static int rx_ready[ROUTER_NUM_INTERFACES];
+static int rx_quota[ROUTER_NUM_INTERFACES];
+static int rx_ready_count;
+static int rx_current;
+static int rx_timeout_ms;
+
+/* Polling mode: spin budget and the start of the current idle period */
+static uint64_t rx_spin_ns;
+static uint64_t rx_idle_since;
+static int rx_polled;
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+void set_rx_timeout(int ms)
+{
+	rx_timeout_ms = ms;
+}
+
+void set_rx_burst(int interface, int burst)
+{
+	DIE(burst <= 0, "Invalid RX burst");
+	rx_burst[interface] = burst;
+}
+
+void set_rx_busy_poll(int spin_us)
+{
+	DIE(spin_us <= 0, "Invalid busy poll time");
+	rx_spin_ns = spin_us * NSEC_PER_USEC;
+
+	for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+#ifdef SO_BUSY_POLL
+		if (setsockopt(interfaces[i], SOL_SOCKET, SO_BUSY_POLL,
+			       &spin_us, sizeof(spin_us)) < 0)
+			perror("SO_BUSY_POLL");
+#endif
+	}
+}
+
+/*
+ * Polling mode, called once every interface has been drained: returns 1 to
+ * keep spinning (all interfaces are marked readable again), or 0 once
+ * nothing has arrived for the spin budget, so the caller sleeps in select
+ */
+static int rx_poll_again(void)
+{
+	uint64_t now = now_ns();
+
+	if (rx_polled || rx_idle_since == 0) {
+		rx_idle_since = now;
+		rx_polled = 0;
+	}
+	if (now - rx_idle_since >= rx_spin_ns) {
+		rx_idle_since = 0;
+		return 0;
+	}
+
+	for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+		if (egress_backlog(i))
+			egress_flush(i);
+		rx_ready[i] = 1;
+	}
+	rx_ready_count = ROUTER_NUM_INTERFACES;
+	rx_quota[rx_current] = rx_burst[rx_current];
+	cpu_relax();
+	return 1;
+}
+
 int get_packet(packet *m) {
 	int res;
-	fd_set set;
+	fd_set set, wset;
 
-	FD_ZERO(&set);
 	while (1) {
+		/*
+		 * Serve the readable interfaces round robin, at most rx_burst
+		 * packets per visit, so a flooded port cannot starve the others.
+		 * An interface leaves the ready set once it has nothing to read.
+		 */
+		while (rx_ready_count > 0) {
+			int i = rx_current;
+
+			if (rx_ready[i] && rx_quota[i] > 0) {
+				if (socket_receive_message(interfaces[i], m) == 0) {
+					rx_quota[i]--;
+					rx_polled = 1;
+					m->interface = i;
+					stats_rx(i, m->len);
+					capture_tap(m->payload, m->len, i);
+					return 0;
+				}
+				rx_ready[i] = 0;
+				rx_ready_count--;
+			}
+
+			rx_current = (i + 1) % ROUTER_NUM_INTERFACES;
+			rx_quota[rx_current] = rx_burst[rx_current];
+		}
+
+		if (rx_spin_ns > 0 && rx_poll_again())
+			continue;
+
+		FD_ZERO(&set);
+		FD_ZERO(&wset);
 		for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
 			FD_SET(interfaces[i], &set);
+			/* wait for room to drain the egress queues */
+			if (egress_backlog(i))
+				FD_SET(interfaces[i], &wset);
 		}
 
-		res = select(interfaces[ROUTER_NUM_INTERFACES - 1] + 1, &set, NULL, NULL, NULL);
+		struct timeval tv = {
+			.tv_sec = rx_timeout_ms / 1000,
+			.tv_usec = (rx_timeout_ms % 1000) * 1000,
+		};
+		res = select(interfaces[ROUTER_NUM_INTERFACES - 1] + 1, &set, &wset, NULL,
+			     rx_timeout_ms > 0 ? &tv : NULL);
+		if (res == -1 && errno == EINTR)
+			return -1; /* let the caller handle the signal */
 		DIE(res == -1, "select");
+		if (res == 0) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
 
 		for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+			if (FD_ISSET(interfaces[i], &wset))
+				egress_flush(i);
 			if (FD_ISSET(interfaces[i], &set)) {
-				socket_receive_message(interfaces[i], m);
-				m->interface = i;
-				return 0;
+				rx_ready[i] = 1;
+				rx_ready_count++;
 			}
 		}
+		rx_quota[rx_current] = rx_burst[rx_current];
 	}
 	return -1;
 }
@@ -82,6 +258,19 @@ char *get_interface_ip(int interface)
 	return inet_ntoa(((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr);
 }
 
+int get_interface_running(int interface)
+{
+	struct ifreq ifr;
+	if (interface == 0)
+		sprintf(ifr.ifr_name, "rr-0-1");
+	else {
+		sprintf(ifr.ifr_name, "r-%u", interface - 1);
+	}
+	if (ioctl(interfaces[interface], SIOCGIFFLAGS, &ifr) == -1)
+		return 0;
+	return (ifr.ifr_flags & IFF_UP) && (ifr.ifr_flags & IFF_RUNNING);
+}
+
 void get_interface_mac(int interface, uint8_t *mac)
 {
 	struct ifreq ifr;
@@ -144,9 +333,20 @@ void init(int argc, char *argv[])
 	for (int i = 0; i < argc; ++i) {
 		printf("Setting up interface: %s\n", argv[i]);
 		interfaces[i] = get_sock(argv[i]);
+
+		struct ifreq ifr;
+		strcpy(ifr.ifr_name, argv[i]);
+		DIE(ioctl(interfaces[i], SIOCGIFMTU, &ifr), "ioctl SIOCGIFMTU");
+		interface_mtu[i] = ifr.ifr_mtu < MAX_MTU ? ifr.ifr_mtu : MAX_MTU;
+		printf("MTU: %d\n", interface_mtu[i]);
 	}
 }
 
+int get_interface_mtu(int interface)
+{
+	return interface_mtu[interface];
+}
+
 
 uint16_t icmp_checksum(uint16_t *buffer, uint32_t size)
 {
@@ -239,7 +439,8 @@ void send_icmp(uint32_t daddr, uint32_t saddr, uint8_t *sha, uint8_t *dha, u_int
 			.sequence = seq,
 		}
 	};
-	packet packet;
+	char buf[128];
+	packet packet = { .payload = buf };
 	void *payload;
 
 	build_ethhdr(&eth_hdr, sha, dha, htons(ETHERTYPE_IP));
@@ -280,7 +481,8 @@ void send_icmp_error(uint32_t daddr, uint32_t saddr, uint8_t *sha, uint8_t *dha,
 		.code = code,
 		.checksum = 0,
 	};
-	packet packet;
+	char buf[128];
+	packet packet = { .payload = buf };
 	void *payload;
 
 	build_ethhdr(&eth_hdr, sha, dha, htons(ETHERTYPE_IP));
@@ -311,10 +513,61 @@ void send_icmp_error(uint32_t daddr, uint32_t saddr, uint8_t *sha, uint8_t *dha,
 	send_packet(interface, &packet);
 }
 
+void send_icmp_frag_needed(uint32_t daddr, uint32_t saddr, uint8_t *sha, uint8_t *dha, struct iphdr *orig, int mtu, int interface)
+{
+	struct ether_header eth_hdr;
+	struct iphdr ip_hdr;
+	struct icmphdr icmp_hdr = {
+		.type = ICMP_DEST_UNREACH,
+		.code = ICMP_FRAG_NEEDED,
+		.checksum = 0,
+		.un.frag = {
+			.mtu = htons(mtu),
+		}
+	};
+	/* ICMP header, offending IP header, 8 bytes of its payload */
+	char icmp[sizeof(struct icmphdr) + 60 + 8];
+	int quoted = orig->ihl * 4 + 8;
+	int icmp_len = sizeof(struct icmphdr) + quoted;
+	char buf[sizeof(struct ether_header) + sizeof(struct iphdr) + sizeof(icmp)];
+	packet packet = { .payload = buf };
+	void *payload;
+
+	build_ethhdr(&eth_hdr, sha, dha, htons(ETHERTYPE_IP));
+	/* No options */
+	ip_hdr.version = 4;
+	ip_hdr.ihl = 5;
+	ip_hdr.tos = 0;
+	ip_hdr.protocol = IPPROTO_ICMP;
+	ip_hdr.tot_len = htons(sizeof(struct iphdr) + icmp_len);
+	ip_hdr.id = htons(1);
+	ip_hdr.frag_off = 0;
+	ip_hdr.ttl = 64;
+	ip_hdr.check = 0;
+	ip_hdr.daddr = daddr;
+	ip_hdr.saddr = saddr;
+	ip_hdr.check = ip_checksum(&ip_hdr, sizeof(struct iphdr));
+
+	memcpy(icmp, &icmp_hdr, sizeof(struct icmphdr));
+	memcpy(icmp + sizeof(struct icmphdr), orig, quoted);
+	((struct icmphdr *)icmp)->checksum = icmp_checksum((uint16_t *)icmp, icmp_len);
+
+	payload = packet.payload;
+	memcpy(payload, &eth_hdr, sizeof(struct ether_header));
+	payload += sizeof(struct ether_header);
+	memcpy(payload, &ip_hdr, sizeof(struct iphdr));
+	payload += sizeof(struct iphdr);
+	memcpy(payload, icmp, icmp_len);
+	packet.len = sizeof(struct ether_header) + sizeof(struct iphdr) + icmp_len;
+
+	send_packet(interface, &packet);
+}
+
 void send_arp(uint32_t daddr, uint32_t saddr, struct ether_header *eth_hdr, int interface, uint16_t arp_op)
 {
 	struct arp_header arp_hdr;
-	packet packet;
+	char buf[128];
+	packet packet = { .payload = buf };
 
 	arp_hdr.htype = htons(ARPHRD_ETHER);
 	arp_hdr.ptype = htons(2048);
@@ -325,7 +578,7 @@ void send_arp(uint32_t daddr, uint32_t saddr, struct ether_header *eth_hdr, int
 	memcpy(arp_hdr.tha, eth_hdr->ether_dhost, 6);
 	arp_hdr.spa = saddr;
 	arp_hdr.tpa = daddr;
-	memset(packet.payload, 0, 1600);
+	memset(buf, 0, sizeof(buf));
 	memcpy(packet.payload, eth_hdr, sizeof(struct ethhdr));
 	memcpy(packet.payload + sizeof(struct ethhdr), &arp_hdr, sizeof(struct arp_header));
 	packet.len = sizeof(struct arp_header) + sizeof(struct ethhdr);
@@ -0,0 +1,76 @@
+#include "stats.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+__thread struct thread_stats *stats;
+
+const char *drop_reason_names[DROP_MAX] = {
+    [DROP_BAD_CHECKSUM] = "bad_checksum",
+    [DROP_NO_ROUTE] = "no_route",
+    [DROP_TTL] = "ttl",
+    [DROP_ARP_QUEUE_FULL] = "arp_queue_full",
+    [DROP_TX_ERROR] = "tx_error",
+    [DROP_ACL] = "acl",
+    [DROP_NAT] = "nat",
+    [DROP_MTU] = "mtu",
+};
+
+static struct stats_segment *segment;
+static char segment_name[64];
+
+static void stats_cleanup(int sig) {
+    shm_unlink(segment_name);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+void stats_init(const char *name, char *if_names[], int n_interfaces) {
+    if (name == NULL) {
+        snprintf(segment_name, sizeof(segment_name), STATS_NAME_FORMAT, getpid());
+    } else {
+        snprintf(segment_name, sizeof(segment_name), "%s", name);
+    }
+
+    int fd = shm_open(segment_name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd >= 0 && ftruncate(fd, sizeof(struct stats_segment)) == 0) {
+        segment = mmap(NULL, sizeof(struct stats_segment), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+        if (segment == MAP_FAILED) {
+            segment = NULL;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (segment == NULL) {
+        fprintf(stderr, "Statistics segment %s unavailable, counters are private\n",
+                segment_name);
+        segment = aligned_alloc(CACHE_LINE, sizeof(struct stats_segment));
+        DIE(segment == NULL, "memory");
+    } else {
+        printf("Statistics exported in %s\n", segment_name);
+        signal(SIGINT, stats_cleanup);
+        signal(SIGTERM, stats_cleanup);
+    }
+
+    memset(segment, 0, sizeof(struct stats_segment));
+    segment->version = STATS_VERSION;
+    segment->n_interfaces = n_interfaces;
+    segment->pid = getpid();
+    for (int i = 0; i < n_interfaces; i++) {
+        snprintf(segment->if_names[i], IFNAMSIZ, "%s", if_names[i]);
+    }
+
+    // Readers check the magic last, after the header is complete
+    __atomic_store_n(&segment->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+
+    stats_register_thread();
+}
+
+void stats_register_thread(void) {
+    uint32_t slot = __atomic_fetch_add(&segment->n_threads, 1, __ATOMIC_ACQ_REL);
+    DIE(slot >= STATS_MAX_THREADS, "Too many statistics threads");
+    stats = &segment->threads[slot];
+}
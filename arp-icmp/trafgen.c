@@ -0,0 +1,457 @@
+#define _GNU_SOURCE /* sendmmsg, recvmmsg */
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <netinet/udp.h>
+#include "skel.h"
+#include "timeutil.h"
+
+/*
+ * trafgen - traffic generator and forwarding benchmark for the router.
+ * Sends a weighted mix of UDP, ICMP echo and ARP frames out of one interface,
+ * at a fixed rate or as fast as the socket takes them, and receives the
+ * forwarded frames on another interface. Reports throughput, loss and one-way
+ * latency percentiles; both interfaces must be on this host, since the
+ * latency is measured against the shared monotonic clock.
+ * Usage: ./trafgen [options] <tx interface> <rx interface>
+ */
+
+#define TG_MAGIC 0x5447454e /* "TGEN" */
+#define TG_BATCH_MAX 256
+#define TG_MAX_SAMPLES (1 << 22) /* latency samples kept */
+#define TG_PATTERN_MAX 1024
+
+enum tg_kind { TG_UDP, TG_ICMP, TG_ARP, TG_KINDS };
+
+static const char *kind_names[TG_KINDS] = {"udp", "icmp", "arp"};
+
+/* Carried by UDP and ICMP frames right after the L4 header */
+struct tg_stamp {
+    uint32_t magic;
+    uint32_t seq;
+    uint64_t sent; /* now_ns() at transmission */
+} __attribute__((packed));
+
+struct tg_config {
+    uint8_t src_mac[ETH_ALEN];
+    uint8_t dst_mac[ETH_ALEN];
+    uint32_t src;       /* host order */
+    uint32_t dst;       /* host order */
+    uint32_t dst_count; /* destinations visited from dst */
+    uint32_t flows;     /* UDP source ports */
+    uint32_t gateway;   /* network order, target of the ARP requests */
+    int weights[TG_KINDS];
+    uint64_t rate;      /* pps, 0 = unlimited */
+    double duration;    /* seconds */
+    int size;           /* frame length */
+    int batch;
+};
+
+static struct tg_config cfg = {
+    .dst_count = 1,
+    .flows = 1,
+    .weights = {[TG_UDP] = 100},
+    .duration = 5,
+    .size = 64,
+    .batch = 32,
+};
+
+static volatile int rx_stop;
+static uint64_t rx_frames;
+static uint32_t *samples;
+static uint64_t n_samples;
+
+static int open_socket(const char *name, int protocol, uint8_t *mac) {
+    int s = socket(AF_PACKET, SOCK_RAW, htons(protocol));
+    DIE(s < 0, "socket");
+
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", name);
+    DIE(ioctl(s, SIOCGIFINDEX, &ifr) < 0, "ioctl SIOCGIFINDEX");
+
+    struct sockaddr_ll addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(protocol);
+    addr.sll_ifindex = ifr.ifr_ifindex;
+    DIE(bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0, "bind");
+
+    if (mac != NULL) {
+        DIE(ioctl(s, SIOCGIFHWADDR, &ifr) < 0, "ioctl SIOCGIFHWADDR");
+        memcpy(mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+    }
+    return s;
+}
+
+static uint16_t checksum(const void *data, int len) {
+    const uint16_t *p = data;
+    uint32_t sum = 0;
+
+    for (; len > 1; len -= 2) {
+        sum += *p++;
+    }
+    if (len) {
+        sum += *(const uint8_t *)p;
+    }
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum += sum >> 16;
+    return ~sum;
+}
+
+/* Smooth weighted round robin, so the kinds are interleaved evenly */
+static int build_pattern(int *pattern) {
+    int total = 0, current[TG_KINDS] = {0}, n = 0;
+
+    for (int k = 0; k < TG_KINDS; k++) {
+        total += cfg.weights[k];
+    }
+    DIE(total <= 0 || total > TG_PATTERN_MAX, "Invalid traffic mix");
+
+    for (; n < total; n++) {
+        int best = 0;
+        for (int k = 0; k < TG_KINDS; k++) {
+            current[k] += cfg.weights[k];
+            if (current[k] > current[best]) {
+                best = k;
+            }
+        }
+        current[best] -= total;
+        pattern[n] = best;
+    }
+    return n;
+}
+
+/* Builds frame number seq of the given kind, returns its length */
+static int build_frame(char *buf, int kind, uint32_t seq) {
+    struct ether_header *eth = (struct ether_header *)buf;
+    memcpy(eth->ether_shost, cfg.src_mac, ETH_ALEN);
+
+    if (kind == TG_ARP) {
+        struct arp_header *arp = (struct arp_header *)(eth + 1);
+        memset(arp, 0, ETH_ZLEN - sizeof(struct ether_header));
+        memset(eth->ether_dhost, 0xff, ETH_ALEN);
+        eth->ether_type = htons(ETHERTYPE_ARP);
+        arp->htype = htons(ARPHRD_ETHER);
+        arp->ptype = htons(ETHERTYPE_IP);
+        arp->hlen = ETH_ALEN;
+        arp->plen = 4;
+        arp->op = htons(ARPOP_REQUEST);
+        memcpy(arp->sha, cfg.src_mac, ETH_ALEN);
+        arp->spa = htonl(cfg.src);
+        memset(arp->tha, 0, ETH_ALEN);
+        arp->tpa = cfg.gateway;
+        return ETH_ZLEN;
+    }
+
+    memcpy(eth->ether_dhost, cfg.dst_mac, ETH_ALEN);
+    eth->ether_type = htons(ETHERTYPE_IP);
+
+    struct iphdr *ip = (struct iphdr *)(eth + 1);
+    int ip_len = cfg.size - sizeof(struct ether_header);
+    // Visit the destinations in a scattered order, so consecutive packets
+    // do not share trie paths
+    uint32_t dst = cfg.dst + (uint32_t)(seq * 2654435761u) % cfg.dst_count;
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->tos = 0;
+    ip->tot_len = htons(ip_len);
+    ip->id = htons(seq);
+    ip->frag_off = 0;
+    ip->ttl = 64;
+    ip->saddr = htonl(cfg.src);
+    ip->daddr = htonl(dst);
+
+    char *l4 = (char *)(ip + 1);
+    int l4_len = ip_len - sizeof(struct iphdr);
+    struct tg_stamp *stamp;
+    memset(l4, 0, l4_len);
+
+    if (kind == TG_UDP) {
+        struct udphdr *udp = (struct udphdr *)l4;
+        ip->protocol = IPPROTO_UDP;
+        udp->source = htons(10000 + seq % cfg.flows);
+        udp->dest = htons(9); // discard
+        udp->len = htons(l4_len);
+        udp->check = 0;       // optional over IPv4
+        stamp = (struct tg_stamp *)(udp + 1);
+    } else {
+        struct icmphdr *icmp = (struct icmphdr *)l4;
+        ip->protocol = IPPROTO_ICMP;
+        icmp->type = ICMP_ECHO;
+        icmp->un.echo.id = htons(0x5447);
+        icmp->un.echo.sequence = htons(seq);
+        stamp = (struct tg_stamp *)(icmp + 1);
+    }
+
+    stamp->magic = htonl(TG_MAGIC);
+    stamp->seq = seq;
+    stamp->sent = now_ns();
+    if (kind == TG_ICMP) {
+        struct icmphdr *icmp = (struct icmphdr *)l4;
+        icmp->checksum = checksum(icmp, l4_len);
+    }
+    ip->check = 0;
+    ip->check = checksum(ip, sizeof(struct iphdr));
+    return cfg.size;
+}
+
+static void *receiver(void *arg) {
+    int s = *(int *)arg;
+    static char bufs[TG_BATCH_MAX][MAX_LEN];
+    struct mmsghdr msgs[TG_BATCH_MAX];
+    struct iovec iovs[TG_BATCH_MAX];
+    struct sockaddr_ll from[TG_BATCH_MAX];
+
+    struct timeval tv = {0, 100000};
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    while (!rx_stop) {
+        for (int i = 0; i < TG_BATCH_MAX; i++) {
+            iovs[i].iov_base = bufs[i];
+            iovs[i].iov_len = MAX_LEN;
+            memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &from[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+        }
+
+        int n = recvmmsg(s, msgs, TG_BATCH_MAX, MSG_WAITFORONE, NULL);
+        if (n < 0) {
+            DIE(errno != EAGAIN && errno != EINTR, "recvmmsg");
+            continue;
+        }
+
+        uint64_t now = now_ns();
+        for (int i = 0; i < n; i++) {
+            if (from[i].sll_pkttype == PACKET_OUTGOING) {
+                continue;
+            }
+
+            struct iphdr *ip = (struct iphdr *)(bufs[i] + sizeof(struct ether_header));
+            char *l4 = (char *)ip + ip->ihl * 4;
+            struct tg_stamp *stamp;
+            if (ip->protocol == IPPROTO_UDP) {
+                stamp = (struct tg_stamp *)(l4 + sizeof(struct udphdr));
+            } else if (ip->protocol == IPPROTO_ICMP) {
+                stamp = (struct tg_stamp *)(l4 + sizeof(struct icmphdr));
+            } else {
+                continue;
+            }
+            if ((char *)(stamp + 1) > bufs[i] + msgs[i].msg_len ||
+                stamp->magic != htonl(TG_MAGIC)) {
+                continue;
+            }
+
+            rx_frames++;
+            if (n_samples < TG_MAX_SAMPLES) {
+                uint64_t delay = now - stamp->sent;
+                samples[n_samples++] = delay > UINT32_MAX ? UINT32_MAX : delay;
+            }
+        }
+    }
+    return NULL;
+}
+
+static int compare_samples(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(double q) {
+    if (n_samples == 0) {
+        return 0;
+    }
+    uint64_t i = q * n_samples;
+    return samples[i < n_samples ? i : n_samples - 1] / 1000.0;
+}
+
+static void parse_mix(char *text) {
+    memset(cfg.weights, 0, sizeof(cfg.weights));
+
+    for (char *tok = strtok(text, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        char name[16];
+        int weight, k;
+        DIE(sscanf(tok, "%15[a-z]=%d", name, &weight) != 2 || weight < 0, "Invalid traffic mix");
+        for (k = 0; k < TG_KINDS && strcmp(name, kind_names[k]) != 0; k++)
+            ;
+        DIE(k == TG_KINDS, "Unknown traffic kind");
+        cfg.weights[k] = weight;
+    }
+}
+
+static void parse_mac(const char *text, uint8_t *mac) {
+    DIE(sscanf(text, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &mac[0], &mac[1], &mac[2], &mac[3],
+               &mac[4], &mac[5]) != 6, "Invalid MAC address");
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [options] <tx interface> <rx interface>\n"
+            "  --dst-mac MAC      router MAC on the tx interface (required)\n"
+            "  --src IP           source address (192.168.0.2)\n"
+            "  --dst IP           first destination address (192.168.1.2)\n"
+            "  --dst-count N      destinations from --dst on (1)\n"
+            "  --flows N          UDP source ports (1)\n"
+            "  --gateway IP       target of the ARP requests (192.168.0.1)\n"
+            "  --mix udp=W,icmp=W,arp=W  weights of the frame kinds (udp=100)\n"
+            "  --rate PPS         0 sends as fast as possible (0)\n"
+            "  --duration SEC     (5)\n"
+            "  --size LEN         frame length (64)\n"
+            "  --batch N          frames per sendmmsg (32)\n",
+            name);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    static struct option long_options[] = {
+        {"dst-mac", required_argument, NULL, 'M'},
+        {"src", required_argument, NULL, 's'},
+        {"dst", required_argument, NULL, 'd'},
+        {"dst-count", required_argument, NULL, 'n'},
+        {"flows", required_argument, NULL, 'f'},
+        {"gateway", required_argument, NULL, 'g'},
+        {"mix", required_argument, NULL, 'x'},
+        {"rate", required_argument, NULL, 'r'},
+        {"duration", required_argument, NULL, 't'},
+        {"size", required_argument, NULL, 'l'},
+        {"batch", required_argument, NULL, 'b'},
+        {0, 0, 0, 0}
+    };
+    int have_mac = 0;
+
+    cfg.src = ntohl(inet_addr("192.168.0.2"));
+    cfg.dst = ntohl(inet_addr("192.168.1.2"));
+    cfg.gateway = inet_addr("192.168.0.1");
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "M:s:d:n:f:g:x:r:t:l:b:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'M':
+                parse_mac(optarg, cfg.dst_mac);
+                have_mac = 1;
+                break;
+            case 's':
+                cfg.src = ntohl(inet_addr(optarg));
+                break;
+            case 'd':
+                cfg.dst = ntohl(inet_addr(optarg));
+                break;
+            case 'n':
+                cfg.dst_count = strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                cfg.flows = strtoul(optarg, NULL, 10);
+                break;
+            case 'g':
+                cfg.gateway = inet_addr(optarg);
+                break;
+            case 'x':
+                parse_mix(optarg);
+                break;
+            case 'r':
+                cfg.rate = strtoull(optarg, NULL, 10);
+                break;
+            case 't':
+                cfg.duration = atof(optarg);
+                break;
+            case 'l':
+                cfg.size = atoi(optarg);
+                break;
+            case 'b':
+                cfg.batch = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2 || !have_mac) {
+        usage(argv[0]);
+    }
+    DIE(cfg.size < (int)(sizeof(struct ether_header) + sizeof(struct iphdr) +
+                         sizeof(struct udphdr) + sizeof(struct tg_stamp)) ||
+        cfg.size > MAX_LEN, "Invalid frame size");
+    DIE(cfg.batch <= 0 || cfg.batch > TG_BATCH_MAX, "Invalid batch");
+    DIE(cfg.dst_count == 0 || cfg.flows == 0, "Invalid address or flow count");
+
+    int pattern[TG_PATTERN_MAX];
+    int pattern_len = build_pattern(pattern);
+
+    int tx = open_socket(argv[optind], ETH_P_ALL, cfg.src_mac);
+    int rx = open_socket(argv[optind + 1], ETH_P_IP, NULL);
+    int one = 1;
+    setsockopt(tx, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+
+    samples = malloc(TG_MAX_SAMPLES * sizeof(uint32_t));
+    DIE(samples == NULL, "memory");
+    pthread_t rx_thread;
+    DIE(pthread_create(&rx_thread, NULL, receiver, &rx) != 0, "pthread_create");
+
+    static char bufs[TG_BATCH_MAX][MAX_LEN];
+    struct mmsghdr msgs[TG_BATCH_MAX];
+    struct iovec iovs[TG_BATCH_MAX];
+    uint64_t sent[TG_KINDS] = {0}, tx_errors = 0;
+    uint32_t seq = 0;
+
+    uint64_t start = now_ns();
+    uint64_t end = start + cfg.duration * NSEC_PER_SEC;
+    uint64_t now = start;
+
+    while (now < end) {
+        // Pace whole batches: wait until the first frame of the batch is due
+        if (cfg.rate != 0) {
+            uint64_t due = start + (uint64_t)seq * NSEC_PER_SEC / cfg.rate;
+            while ((now = now_ns()) < due) {
+                if (due - now > 100 * NSEC_PER_USEC) {
+                    usleep((due - now) / NSEC_PER_USEC / 2);
+                }
+            }
+        }
+
+        int kinds[TG_BATCH_MAX];
+        for (int i = 0; i < cfg.batch; i++) {
+            kinds[i] = pattern[(seq + i) % pattern_len];
+            iovs[i].iov_base = bufs[i];
+            iovs[i].iov_len = build_frame(bufs[i], kinds[i], seq + i);
+            memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int n = sendmmsg(tx, msgs, cfg.batch, 0);
+        if (n < 0) {
+            DIE(errno != ENOBUFS && errno != EAGAIN && errno != EINTR, "sendmmsg");
+            tx_errors++;
+            n = 0;
+        }
+        for (int i = 0; i < n; i++) {
+            sent[kinds[i]]++;
+        }
+        seq += n;
+        now = now_ns();
+    }
+    double elapsed = (double)(now - start) / NSEC_PER_SEC;
+
+    // Let the frames still in flight arrive
+    usleep(200000);
+    rx_stop = 1;
+    pthread_join(rx_thread, NULL);
+
+    uint64_t forwardable = sent[TG_UDP] + sent[TG_ICMP];
+    uint64_t total = forwardable + sent[TG_ARP];
+    double loss = forwardable ? 100.0 * (1.0 - (double)rx_frames / forwardable) : 0;
+    qsort(samples, n_samples, sizeof(uint32_t), compare_samples);
+
+    printf("tx: %lu frames (udp %lu, icmp %lu, arp %lu) in %.2f s, %.3f Mpps, %lu send errors\n",
+           total, sent[TG_UDP], sent[TG_ICMP], sent[TG_ARP], elapsed, total / elapsed / 1e6,
+           tx_errors);
+    printf("rx: %lu frames, %.3f Mpps, loss %.2f%%\n", rx_frames, rx_frames / elapsed / 1e6, loss);
+    printf("latency (us): p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n", percentile_us(0.5),
+           percentile_us(0.9), percentile_us(0.99), percentile_us(0.999), percentile_us(1));
+    printf("RESULT tx_mpps=%.3f rx_mpps=%.3f loss=%.2f p50_us=%.1f p90_us=%.1f p99_us=%.1f "
+           "p999_us=%.1f\n",
+           total / elapsed / 1e6, rx_frames / elapsed / 1e6, loss, percentile_us(0.5),
+           percentile_us(0.9), percentile_us(0.99), percentile_us(0.999));
+    return 0;
+}
@@ -1,6 +1,9 @@
 #include "trie.h"
+#include "nexthop.h"
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 void init_trie(struct trie_node **t, int interface, uint32_t next_hop) {
     *t = (struct trie_node *)malloc(sizeof(struct trie_node));
@@ -9,6 +12,7 @@ void init_trie(struct trie_node **t, int interface, uint32_t next_hop) {
         return;
     }
     (*t)->l = (*t)->r = NULL;
+    (*t)->group = NULL;
     (*t)->interface = interface;
     (*t)->next_hop = next_hop;
 }
@@ -35,32 +39,81 @@ int get_bit_count_from_mask(uint32_t mask) {
     return __builtin_popcount(mask);
 }
 
-void insert_route(struct trie_node *root, uint32_t prefix, uint32_t mask, uint32_t next_hop, int interface) {
-    int cidr = get_bit_count_from_mask(mask);
+/* Node at the end of the path of prefix/cidr, created if create is set; root
+ * is the node at depth start of that path */
+static struct trie_node **route_node(struct trie_node **root, uint32_t prefix, int start, int cidr,
+                                     int create) {
+    struct trie_node **t = root;
 
     prefix = htonl(prefix); // Convert to Big Endian
 
-    for (int i = 0; i < cidr - 1; i++) {
-        if (((prefix >> (31 - i)) & 1) == 1) {
-            if (root->r == NULL) {
-                insert_right(&root, -1, 0);
+    for (int i = start; i < cidr; i++) {
+        if (*t == NULL) {
+            if (!create) {
+                return NULL;
             }
-            root = root->r;
-        } else {
-            if (root->l == NULL) {
-                insert_left(&root, -1, 0);
-            }
-            root = root->l;
+            init_trie(t, -1, 0);
         }
+        t = (((prefix >> (31 - i)) & 1) == 1) ? &(*t)->r : &(*t)->l;
     }
 
-    // Add interface to last bit
-    (((prefix >> (32 - cidr)) & 1) == 1) ? insert_right(&root, interface, next_hop)
-                                         : insert_left(&root, interface, next_hop);
+    if (*t == NULL && create) {
+        init_trie(t, -1, 0);
+    }
+    return t;
+}
+
+void insert_route(struct trie_node *root, uint32_t prefix, uint32_t mask, uint32_t next_hop, int interface) {
+    int cidr = get_bit_count_from_mask(mask);
+
+    // The node may already exist on the path of a longer prefix, so the route
+    // is written into it rather than below it
+    struct trie_node **t = route_node(&root, prefix, 0, cidr, 1);
+    (*t)->interface = interface;
+    (*t)->next_hop = next_hop;
+    (*t)->group = NULL;
+}
+
+void insert_route_group(struct trie_node *root, uint32_t prefix, uint32_t mask, struct nh_group *group) {
+    struct trie_node **t = route_node(&root, prefix, 0, get_bit_count_from_mask(mask), 1);
+    (*t)->interface = nh_group_active(group, &(*t)->next_hop);
+    (*t)->group = group;
+}
+
+/* Frees the nodes left without a route or children along the path */
+static void prune(struct trie_node **t, uint32_t prefix, int depth, int cidr) {
+    if (*t == NULL) {
+        return;
+    }
+
+    if (depth < cidr) {
+        int bit = (prefix >> (31 - depth)) & 1;
+        prune(bit ? &(*t)->r : &(*t)->l, prefix, depth + 1, cidr);
+    } else {
+        (*t)->interface = -1;
+        (*t)->next_hop = 0;
+        (*t)->group = NULL;
+    }
+
+    if (depth > 0 && (*t)->interface == -1 && (*t)->l == NULL && (*t)->r == NULL) {
+        free(*t);
+        *t = NULL;
+    }
+}
+
+int delete_route(struct trie_node *root, uint32_t prefix, uint32_t mask) {
+    int cidr = get_bit_count_from_mask(mask);
+    struct trie_node **t = route_node(&root, prefix, 0, cidr, 0);
+
+    if (t == NULL || *t == NULL || (*t)->interface == -1) {
+        return 0;
+    }
+    prune(&root, htonl(prefix), 0, cidr);
+    return 1;
 }
 
 int search_route(struct trie_node *root, uint32_t ip, uint32_t *next_hop) {
-    int interface = -1;
+    struct trie_node *match = root->interface != -1 ? root : NULL; // default route
 
     ip = htonl(ip); // Convert to Big Endian
 
@@ -70,10 +123,123 @@ int search_route(struct trie_node *root, uint32_t ip, uint32_t *next_hop) {
             break; // end of path
         }
         if (root->interface != -1) {
-            interface = root->interface; // found match
-            *next_hop = root->next_hop;
+            match = root; // found match
         }
     }
 
-    return interface;
-}
\ No newline at end of file
+    if (match == NULL) {
+        return -1;
+    }
+    if (match->group != NULL) {
+        return nh_group_active(match->group, next_hop);
+    }
+    *next_hop = match->next_hop;
+    return match->interface;
+}
+
+static void set_route(struct trie_node *t, const struct trie_route *r) {
+    if (r->group != NULL) {
+        t->interface = nh_group_active(r->group, &t->next_hop);
+    } else {
+        t->interface = r->interface;
+        t->next_hop = r->next_hop;
+    }
+    t->group = r->group;
+}
+
+struct build_job {
+    struct trie_route *routes;      /* grouped by partition */
+    int start[TRIE_PARTITIONS + 1]; /* first route of each partition */
+    struct trie_node *sub[TRIE_PARTITIONS];
+    int next;                       /* next partition to build */
+};
+
+/* Builds the subtries of unclaimed partitions until none is left */
+static void *build_worker(void *arg) {
+    struct build_job *job = arg;
+    int p;
+
+    while ((p = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < TRIE_PARTITIONS) {
+        for (int i = job->start[p]; i < job->start[p + 1]; i++) {
+            struct trie_route *r = &job->routes[i];
+            struct trie_node **t = route_node(&job->sub[p], r->prefix, TRIE_SPLIT_BITS,
+                                              get_bit_count_from_mask(r->mask), 1);
+            set_route(*t, r);
+        }
+    }
+    return NULL;
+}
+
+/* Partition of a route, TRIE_PARTITIONS for those shorter than the split */
+static int partition(const struct trie_route *r) {
+    if (get_bit_count_from_mask(r->mask) < TRIE_SPLIT_BITS) {
+        return TRIE_PARTITIONS;
+    }
+    return ntohl(r->prefix) >> (32 - TRIE_SPLIT_BITS);
+}
+
+struct trie_node *build_trie(struct trie_route *routes, int n, int threads) {
+    struct build_job *job = calloc(1, sizeof(struct build_job));
+    struct trie_route *sorted = malloc((n + 1) * sizeof(struct trie_route));
+    int count[TRIE_PARTITIONS + 1] = {0};
+    struct trie_node *root;
+
+    if (job == NULL || sorted == NULL) {
+        printf("Memory error\n");
+        exit(1);
+    }
+
+    // Counting sort on the top bits; it is stable, so the last of several
+    // lines for the same prefix still wins
+    for (int i = 0; i < n; i++) {
+        count[partition(&routes[i])]++;
+    }
+    for (int p = 0; p < TRIE_PARTITIONS; p++) {
+        job->start[p + 1] = job->start[p] + count[p];
+    }
+    int pos[TRIE_PARTITIONS + 1];
+    memcpy(pos, job->start, sizeof(pos));
+    for (int i = 0; i < n; i++) {
+        sorted[pos[partition(&routes[i])]++] = routes[i];
+    }
+    job->routes = sorted;
+
+    // Subtries below the split are independent: build them concurrently
+    pthread_t workers[TRIE_MAX_THREADS];
+    int started = 0;
+    if (threads > TRIE_MAX_THREADS) {
+        threads = TRIE_MAX_THREADS;
+    }
+    for (; started < threads - 1; started++) {
+        if (pthread_create(&workers[started], NULL, build_worker, job) != 0) {
+            break; // the remaining work is shared by the threads we have
+        }
+    }
+    build_worker(job);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    // Stitch the subtries under the top levels, then add the short routes
+    init_trie(&root, -1, 0);
+    for (int p = 0; p < TRIE_PARTITIONS; p++) {
+        if (job->sub[p] == NULL) {
+            continue;
+        }
+        uint32_t prefix = htonl((uint32_t)p << (32 - TRIE_SPLIT_BITS));
+        struct trie_node **parent = route_node(&root, prefix, 0, TRIE_SPLIT_BITS - 1, 1);
+        if (p & 1) {
+            (*parent)->r = job->sub[p];
+        } else {
+            (*parent)->l = job->sub[p];
+        }
+    }
+    for (int i = job->start[TRIE_PARTITIONS]; i < n; i++) {
+        struct trie_route *r = &sorted[i];
+        set_route(*route_node(&root, r->prefix, 0, get_bit_count_from_mask(r->mask), 1), r);
+    }
+
+    free(sorted);
+    free(job);
+    return root;
+}